@@ -0,0 +1,360 @@
+/*
+ * libsysjitter
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Description:
+ *
+ * The parts of sysjitter that an application can use to measure the
+ * jitter seen by its own threads.  See sysjitter.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+#endif
+
+#include "sysjitter.h"
+
+
+uint64_t sj_hist_bucket_max(unsigned b)
+{
+  unsigned shift;
+
+  if( b < 2 * SJ_HIST_SUB_N )
+    return b;
+  shift = (b >> SJ_HIST_SUB_BITS) - 1;
+  return ((uint64_t) (b - (shift << SJ_HIST_SUB_BITS)) << shift) +
+    ((uint64_t) 1 << shift) - 1;
+}
+
+
+/* Clamped to the exact [min] and [max] so we never report a value that
+ * was not seen.
+ */
+uint64_t sj_hist_value_at_rank(const struct sj_histogram* h, uint64_t rank,
+                               uint64_t min, uint64_t max)
+{
+  uint64_t cum = 0, v;
+  unsigned b;
+
+  for( b = 0; b < SJ_HIST_N_BUCKETS; ++b )
+    if( (cum += h->counts[b]) > rank )
+      break;
+  v = sj_hist_bucket_max(b);
+  if( v < min )  v = min;
+  if( v > max )  v = max;
+  return v;
+}
+
+
+static uint64_t measure_cpu_hz(void)
+{
+  struct timeval tvs, tve;
+  uint64_t s, e;
+  double sec;
+
+  sj_frc(&s);
+  e = s;
+  gettimeofday(&tvs, NULL);
+  while( e - s < 1000000 )
+    sj_frc(&e);
+  gettimeofday(&tve, NULL);
+  sec = tve.tv_sec - tvs.tv_sec + (tve.tv_usec - tvs.tv_usec) / 1e6;
+  return (uint64_t) ((e - s) / sec);
+}
+
+
+unsigned sj_measure_cpu_mhz(void)
+{
+  uint64_t m, mprev, d;
+
+  mprev = measure_cpu_hz();
+  do {
+    m = measure_cpu_hz();
+    if( m > mprev )  d = m - mprev;
+    else             d = mprev - m;
+    mprev = m;
+  } while( d > m / 1000 );
+
+  return (unsigned) (m / 1000000);
+}
+
+
+unsigned sj_platform_cpu_mhz(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+  unsigned long khz;
+  FILE* f;
+  int ok;
+
+  /* Not in mainline, but some kernels export their tsc_khz here. */
+  if( (f = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r")) ) {
+    ok = fscanf(f, "%lu", &khz) == 1 && khz > 0;
+    fclose(f);
+    if( ok )
+      return (khz + 500) / 1000;
+  }
+  /* TSC/crystal ratio and the crystal frequency. */
+  if( __get_cpuid_max(0, NULL) >= 0x15 ) {
+    __cpuid_count(0x15, 0, a, b, c, d);
+    if( a != 0 && b != 0 && c != 0 )
+      return ((uint64_t) c * b / a + 500000) / 1000000;
+  }
+  /* Hypervisor timing leaf, which gives the (virtual) TSC rate in kHz. */
+  __cpuid(1, a, b, c, d);
+  if( c & (1u << 31) ) {
+    __cpuid(0x40000000, a, b, c, d);
+    if( a >= 0x40000010 ) {
+      __cpuid(0x40000010, a, b, c, d);
+      if( a != 0 )
+        return (a + 500) / 1000;
+    }
+  }
+  return 0;
+#elif defined(__aarch64__)
+  uint64_t hz;
+  __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(hz));
+  return (hz + 500000) / 1000000;
+#elif defined(__PPC64__)
+  unsigned long hz = 0;
+  char line[128];
+  FILE* f;
+
+  if( (f = fopen("/proc/cpuinfo", "r")) == NULL )
+    return 0;
+  while( fgets(line, sizeof(line), f) )
+    if( sscanf(line, "timebase : %lu", &hz) == 1 )
+      break;
+  fclose(f);
+  return (hz + 500000) / 1000000;
+#else
+  return 0;
+#endif
+}
+
+
+int sj_tsc_invariant(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+  char line[4096];
+  int ok = 0;
+  FILE* f;
+
+  if( __get_cpuid_max(0x80000000, NULL) >= 0x80000007 ) {
+    __cpuid(0x80000007, a, b, c, d);
+    if( (d >> 8) & 1 )
+      return 1;
+  }
+  /* Hypervisors often hide the CPUID bit, but the kernel may know better. */
+  if( (f = fopen("/proc/cpuinfo", "r")) == NULL )
+    return 0;
+  while( fgets(line, sizeof(line), f) )
+    if( strncmp(line, "flags", 5) == 0 ) {
+      ok = strstr(line, " constant_tsc") && strstr(line, " nonstop_tsc");
+      break;
+    }
+  fclose(f);
+  return ok;
+#else
+  return -1;
+#endif
+}
+
+
+int sj_has_rdtscp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+
+  if( __get_cpuid_max(0x80000000, NULL) < 0x80000001 )
+    return 0;
+  __cpuid(0x80000001, a, b, c, d);
+  return (d >> 27) & 1;
+#else
+  return 0;
+#endif
+}
+
+
+const char* sj_hypervisor(void)
+{
+  static char name[32];
+  FILE* f;
+#if defined(__x86_64__) || defined(__i386__)
+  static const struct { char sig[13]; const char* name; } sigs[] = {
+    { "KVMKVMKVM",    "kvm" },
+    { "Microsoft Hv", "hyperv" },
+    { "VMwareVMware", "vmware" },
+    { "XenVMMXenVMM", "xen" },
+    { "TCGTCGTCGTCG", "qemu" },
+    { "ACRNACRNACRN", "acrn" },
+    { "bhyve bhyve ", "bhyve" },
+  };
+  unsigned a, b, c, d, i, sig[3];
+
+  __cpuid(1, a, b, c, d);
+  if( c & (1u << 31) ) {
+    __cpuid(0x40000000, a, sig[0], sig[1], sig[2]);
+    for( i = 0; i < sizeof(sigs) / sizeof(sigs[0]); ++i )
+      if( memcmp(sig, sigs[i].sig, 12) == 0 )
+        return sigs[i].name;
+    return "unknown";
+  }
+#endif
+  if( (f = fopen("/sys/hypervisor/type", "r")) != NULL ) {
+    if( fscanf(f, "%31s", name) != 1 )
+      strcpy(name, "unknown");
+    fclose(f);
+    return name;
+  }
+  return NULL;
+}
+
+
+int sj_probe_init(struct sj_probe* p, unsigned threshold_nsec,
+                  unsigned cpu_mhz)
+{
+  memset(p, 0, sizeof(*p));
+  if( cpu_mhz == 0 && (cpu_mhz = sj_platform_cpu_mhz()) == 0 )
+    cpu_mhz = sj_measure_cpu_mhz();
+  p->cpu_mhz = cpu_mhz;
+  p->threshold = (uint64_t) threshold_nsec * cpu_mhz / 1000;
+  if( p->threshold == 0 )
+    p->threshold = 1;
+  if( (p->hist = malloc(sizeof(*p->hist))) == NULL )
+    return -1;
+  sj_probe_start(p);
+  return 0;
+}
+
+
+void sj_probe_free(struct sj_probe* p)
+{
+  free(p->hist);
+  p->hist = NULL;
+}
+
+
+void sj_probe_start(struct sj_probe* p)
+{
+  memset(p->hist, 0, sizeof(*p->hist));
+  p->int_n = 0;
+  p->int_total = 0;
+  p->int_min = (uint64_t) -1;
+  p->int_max = 0;
+  sj_frc(&p->start);
+  p->prev = p->start;
+}
+
+
+/* Out of line, to keep sj_probe() small. */
+void __attribute__((noinline)) sj_probe_record(struct sj_probe* p,
+                                               uint64_t diff)
+{
+  sj_hist_inc(p->hist->counts, diff);
+  p->int_total += diff;
+  if( diff < p->int_min )
+    p->int_min = diff;
+  if( diff > p->int_max )
+    p->int_max = diff;
+  __atomic_store_n(&p->int_n, p->int_n + 1, __ATOMIC_RELAXED);
+}
+
+
+#define SJ_STATS_FIELD(f)  { #f"(ns)", offsetof(struct sj_stats, f) }
+
+const struct sj_stats_field sj_stats_fields[SJ_STATS_N_FIELDS] = {
+  SJ_STATS_FIELD(int_min),
+  SJ_STATS_FIELD(int_median),
+  SJ_STATS_FIELD(int_mean),
+  SJ_STATS_FIELD(int_90),
+  SJ_STATS_FIELD(int_99),
+  SJ_STATS_FIELD(int_999),
+  SJ_STATS_FIELD(int_9999),
+  SJ_STATS_FIELD(int_99999),
+  SJ_STATS_FIELD(int_max),
+  SJ_STATS_FIELD(int_total),
+};
+
+#undef SJ_STATS_FIELD
+
+
+void sj_stats_from_hist(struct sj_stats* s, unsigned cpu_mhz,
+                        const struct sj_histogram* h, uint64_t n,
+                        uint64_t min, uint64_t max, uint64_t total,
+                        uint64_t runtime)
+{
+#define ns(c)   ((c) * 1000 / cpu_mhz)
+#define pc(p)   ns(sj_hist_value_at_rank(h, (uint64_t) (n * (p)), min, max))
+
+  memset(s, 0, sizeof(*s));
+  s->cpu_mhz = cpu_mhz;
+  s->runtime = ns(runtime);
+  s->int_n = n;
+  s->int_total = ns(total);
+  s->int_total_pc = runtime ? total * 1e2 / runtime : 0.0;
+  if( n == 0 )
+    return;
+  s->int_min = ns(min);
+  s->int_max = ns(max);
+  s->int_mean = ns(total / n);
+  s->int_median = pc(0.5);
+  s->int_90 = pc(0.9);
+  s->int_99 = pc(0.99);
+  s->int_999 = pc(0.999);
+  s->int_9999 = pc(0.9999);
+  s->int_99999 = pc(0.99999);
+
+#undef pc
+#undef ns
+}
+
+
+/* The counts are read without locking, so when taken from another thread
+ * a snapshot may be out by the odd interruption.
+ */
+void sj_probe_snapshot(const struct sj_probe* p, struct sj_stats* s)
+{
+  uint64_t now, n = __atomic_load_n(&p->int_n, __ATOMIC_RELAXED);
+
+  sj_frc(&now);
+  sj_stats_from_hist(s, p->cpu_mhz, p->hist, n, p->int_min, p->int_max,
+                     p->int_total, now - p->start);
+}
+
+
+void sj_stats_write(const struct sj_stats* s, FILE* f)
+{
+  unsigned k;
+
+  fprintf(f, "cpu_mhz: %u\n", s->cpu_mhz);
+  fprintf(f, "runtime(ns): %"PRIu64"\n", s->runtime);
+  fprintf(f, "int_n: %"PRIu64"\n", s->int_n);
+  for( k = 0; k < SJ_STATS_N_FIELDS; ++k )
+    fprintf(f, "%s: %"PRIu64"\n", sj_stats_fields[k].label,
+            sj_stats_get(s, k));
+  fprintf(f, "int_total(%%): %.3f\n", s->int_total_pc);
+}
@@ -0,0 +1,178 @@
+/*
+ * sysjitter-dump
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Description:
+ *
+ * sysjitter-dump converts raw files written by "sysjitter --raw-format=bin"
+ * into the same text columns that sysjitter writes by default.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sysjitter_raw.h"
+
+
+/* Used as prefix for error and warning messages. */
+#define APP_NAME  "sysjitter-dump"
+
+
+static const struct sj_raw_header* h;
+
+
+static uint64_t cycles_to_ns(uint64_t cycles)
+{
+  return cycles * 1000 / h->cpu_mhz;
+}
+
+
+static uint64_t cycles_to_us(uint64_t cycles)
+{
+  return cycles / h->cpu_mhz;
+}
+
+
+static float cycles_to_sec_f(uint64_t cycles)
+{
+  return cycles / (h->cpu_mhz * 1e6);
+}
+
+
+static void dump(FILE* f)
+{
+  static const char* const clocks[] = SJ_CLOCK_NAMES;
+  const struct sj_raw_record* recs;
+  const struct sj_raw_record* i;
+  const struct sj_raw_record* prev;
+  const uint32_t* causes = NULL;
+  uint64_t n_interruptions = h->n_records + h->n_dropped;
+  uint64_t delta;
+  char cause[64];
+
+  recs = (const void*) ((const char*) h + h->header_size);
+  if( h->flags & SJ_RAW_F_CAUSES )
+    causes = (const void*) (recs + h->n_records);
+
+  fprintf(f, "# cpu_mhz: %u\n", h->cpu_mhz);
+  if( h->version >= 2 )
+    fprintf(f, "# clock: %s\n",
+            h->clock < SJ_N_CLOCKS ? clocks[h->clock] : "unknown");
+  fprintf(f, "# threshold: %uns\n", h->threshold_nsec);
+  fprintf(f, "# n_interruptions: %"PRIu64"\n", n_interruptions);
+  if( n_interruptions == 0 )
+    return;
+  delta = h->frc_stop - h->frc_start;
+  fprintf(f, "# interruption: %f%%\n", 100.0 * h->int_total / delta);
+  fprintf(f, "# total_interruption: %"PRId64" cycles\n", h->int_total);
+  fprintf(f, "# total_runtime: %"PRIu64" cycles\n", delta);
+  fprintf(f, "# total_interruption: %.9f seconds\n",
+          cycles_to_sec_f(h->int_total));
+  fprintf(f, "# total_runtime: %.9f seconds\n", cycles_to_sec_f(delta));
+  if( h->flags & SJ_RAW_F_STREAM )
+    fprintf(f, "# dropped: %"PRIu64"\n", h->n_dropped);
+  fprintf(f, "#\n");
+
+  if( ! (h->flags & SJ_RAW_F_SORTED) ) {
+    fprintf(f, "#      Timestamp      delta   <== interruption =>%s\n",
+            causes ? "   cause" : "");
+    fprintf(f, "#         (nsec)     (usec)   (cycles)     (nsec)\n");
+    /*         "1234567890123456 1234567890 1234567890 1234567890" */
+
+    i = prev = recs;
+    for( ; i < recs + h->n_records; prev = i, ++i ) {
+      delta = i->ts - prev->ts;
+      fprintf(f, "%16"PRIu64" %10"PRIu64" %10"PRId64" %10"PRIu64,
+              cycles_to_ns(i->ts - h->frc_start),
+              cycles_to_us(delta), i->diff, cycles_to_ns(i->diff));
+      if( causes )
+        fprintf(f, " %s", sj_format_causes(cause, sizeof(cause),
+                                           causes[i - recs]));
+      fprintf(f, "\n");
+    }
+  }
+  else {
+    fprintf(f, "#      Timestamp   <== interruption =>%s\n",
+            causes ? "   cause" : "");
+    fprintf(f, "#         (nsec)   (cycles)     (nsec)\n");
+    /*         "1234567890123456 1234567890 1234567890" */
+
+    for( i = recs; i < recs + h->n_records; ++i ) {
+      fprintf(f, "%16"PRIu64" %10"PRId64" %10"PRIu64,
+              cycles_to_ns(i->ts - h->frc_start),
+              i->diff, cycles_to_ns(i->diff));
+      if( causes )
+        fprintf(f, " %s", sj_format_causes(cause, sizeof(cause),
+                                           causes[i - recs]));
+      fprintf(f, "\n");
+    }
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  struct stat st;
+  void* p;
+  int fd;
+
+  if( argc != 2 || argv[1][0] == '-' ) {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s RAW-FILE\n", APP_NAME);
+    exit(1);
+  }
+
+  if( (fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0 ) {
+    fprintf(stderr, "%s: ERROR: Could not open '%s' (%s)\n",
+            APP_NAME, argv[1], strerror(errno));
+    exit(2);
+  }
+  if( st.st_size < sizeof(*h) ||
+      (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED ) {
+    fprintf(stderr, "%s: ERROR: Could not map '%s'\n", APP_NAME, argv[1]);
+    exit(2);
+  }
+  h = p;
+  if( memcmp(h->magic, SJ_RAW_MAGIC, sizeof(SJ_RAW_MAGIC)) != 0 ||
+      h->version == 0 || h->version > SJ_RAW_VERSION ) {
+    fprintf(stderr, "%s: ERROR: '%s' is not a sysjitter binary raw file\n",
+            APP_NAME, argv[1]);
+    exit(2);
+  }
+  if( h->cpu_mhz == 0 || h->header_size < sizeof(*h) ||
+      h->header_size + h->n_records * (sizeof(struct sj_raw_record) +
+        ((h->flags & SJ_RAW_F_CAUSES) ? sizeof(uint32_t) : 0)) >
+      st.st_size ) {
+    fprintf(stderr, "%s: ERROR: '%s' is truncated or corrupt\n",
+            APP_NAME, argv[1]);
+    exit(2);
+  }
+
+  dump(stdout);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * sysjitter-probe
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Description:
+ *
+ * sysjitter-probe is a minimal user of libsysjitter: it spins in a polling
+ * loop with a probe in it for the given time, then writes the probe's
+ * stats.  An application would put sj_probe() in its own loop.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sysjitter.h"
+
+
+/* Used as prefix for error and warning messages. */
+#define APP_NAME  "sysjitter-probe"
+
+
+/* Stands in for the application's work. */
+static volatile unsigned long polls;
+
+
+static double now_secs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char* argv[])
+{
+  unsigned runtime_secs, threshold_nsec;
+  struct sj_probe p;
+  struct sj_stats stats;
+  double end;
+  char dummy;
+
+  if( argc != 3 ||
+      sscanf(argv[1], "%u%c", &runtime_secs, &dummy) != 1 ||
+      sscanf(argv[2], "%u%c", &threshold_nsec, &dummy) != 1 ) {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s RUNTIME_SECS THRESHOLD_NSEC\n", APP_NAME);
+    exit(1);
+  }
+
+  if( sj_probe_init(&p, threshold_nsec, 0) < 0 ) {
+    fprintf(stderr, "%s: ERROR: Out of memory\n", APP_NAME);
+    exit(2);
+  }
+  end = now_secs() + runtime_secs;
+  sj_probe_start(&p);
+  do {
+    sj_probe(&p);
+    ++polls;
+  } while( (polls & 0xffff) || now_secs() < end );
+  sj_probe_snapshot(&p, &stats);
+  sj_stats_write(&stats, stdout);
+  sj_probe_free(&p);
+  return 0;
+}
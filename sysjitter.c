@@ -35,13 +35,31 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+#include <complex.h>
 #include <sys/sysinfo.h>
 #include <sys/types.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/perf_event.h>
+
+#include "sysjitter.h"
+#include "sysjitter_raw.h"
+#include "sysjitter_shm.h"
+#ifdef SYSJITTER_MPI
+# include <mpi.h>
+#endif
 
 
 /* Used as prefix for error and warning messages. */
@@ -56,11 +74,46 @@ static void usage_msg(FILE* f)
   fprintf(f, "options:\n");
   fprintf(f, "  --runtime SECONDS\n");
   fprintf(f, "  --raw FILENAME-PREFIX\n");
+  fprintf(f, "  --raw-format text|bin\n");
   fprintf(f, "  --cores COMMA-SEP-LIST-OF-CORES-OR-RANGES\n");
+  fprintf(f, "  --no-smt-siblings\n");
   fprintf(f, "  --sort\n");
+  fprintf(f, "  --stream\n");
+  fprintf(f, "  --ring-size ENTRIES\n");
+  fprintf(f, "  --housekeeping CORE\n");
+  fprintf(f, "  --calibrate\n");
+  fprintf(f, "  --no-calibration-run\n");
+  fprintf(f, "  --mem default|thp|hugetlb\n");
+  fprintf(f, "  --mlock\n");
+  fprintf(f, "  --rt-prio PRIORITY\n");
+  fprintf(f, "  --rt-policy fifo|rr|deadline\n");
+  fprintf(f, "  --interval SECONDS\n");
+  fprintf(f, "  --interval-file FILENAME\n");
+  fprintf(f, "  --attribute\n");
+  fprintf(f, "  --perf-causes\n");
+  fprintf(f, "  --perf-pages PAGES\n");
+  fprintf(f, "  --msr\n");
+  fprintf(f, "  --loop classic|reg|reg-n16|reg-n16-u4|reg-n64-u8\n");
+  fprintf(f, "  --clock rdtsc|rdtscp|lfence-rdtsc|cntvct|isb-cntvct|"
+          "clock_gettime\n");
+  fprintf(f, "  --mode busy|wakeup\n");
+  fprintf(f, "  --wakeup-period USEC\n");
+  fprintf(f, "  --workload walk:SIZE[k|m|g]\n");
+  fprintf(f, "  --bins COMMA-SEP-LIST-OF-NSEC|log\n");
+  fprintf(f, "  --load CORES:membw|syscall|io|tlb\n");
+  fprintf(f, "  --coincidence K[:WINDOW_NSEC]\n");
+  fprintf(f, "  --trials N\n");
+  fprintf(f, "  --gap SECONDS\n");
+  fprintf(f, "  --periodicity\n");
+  fprintf(f, "  --trigger NSEC[:stop]\n");
+  fprintf(f, "  --daemon\n");
+  fprintf(f, "  --save-baseline FILENAME\n");
+  fprintf(f, "  --compare FILENAME --max-regress METRIC=LIMIT[%%],...\n");
   fprintf(f, "  --verbose\n");
   fprintf(f, "  --help\n");
   fprintf(f, "  --version\n");
+  fprintf(f, "\n");
+  fprintf(f, "Values go as --option VALUE or --option=VALUE.\n");
 }
 
 
@@ -73,37 +126,23 @@ static void usage_err(void)
 
 #  define relax()  sched_yield()
 
-#ifdef __GNUC__
-# define atomic_inc(ptr)   __sync_add_and_fetch((ptr), 1)
-# if defined(__x86_64__)
-static inline void frc(uint64_t* pval)
-{
-  uint32_t low, high;
-  __asm__ __volatile__("rdtsc" : "=a" (low) , "=d" (high));
-  *pval = ((uint64_t) high << 32) | low;
-}
-# elif defined(__i386__)
-static inline void frc(uint64_t* pval)
-{
-  __asm__ __volatile__("rdtsc" : "=A" (*pval));
-}
-# elif defined(__PPC64__)
-static inline void frc(uint64_t* pval)
-{
-  __asm__ __volatile__("mfspr %0, 268\n" : "=r" (*pval));
-}
-# elif defined(__aarch64__)
-static inline void frc(uint64_t* pval)
-{
-  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(*pval));
-}
-# else
-#  error Need frc() for this platform.
-# endif
+#define atomic_inc(ptr)   __sync_add_and_fetch((ptr), 1)
+
+
+/* The counter sj_frc() reads, which is what --clock defaults to. */
+#if defined(__x86_64__) || defined(__i386__)
+# define CLOCK_NATIVE  SJ_CLOCK_RDTSC
+#elif defined(__aarch64__)
+# define CLOCK_NATIVE  SJ_CLOCK_CNTVCT
 #else
-# error Need to add support for this compiler.
+# define CLOCK_NATIVE  SJ_CLOCK_MFTB
 #endif
 
+static const char* const clock_names[] = SJ_CLOCK_NAMES;
+
+
+#define CACHE_LINE  64
+
 
 typedef uint64_t stamp_t;   /* timestamp */
 typedef uint64_t cycles_t;  /* number of cycles */
@@ -116,16 +155,236 @@ enum command {
 };
 
 
+/* Per-core kernel counters (interrupts, softirqs, scheduler) for the
+ * measured cores, as read from /proc.  [vals] has [n_threads] entries for
+ * each counter.
+ */
+struct counters {
+  int                  n;
+  int                  cap;
+  char               (*names)[40];
+  uint64_t*            vals;
+};
+
+
+/* Kernel events we ask perf for in --perf-causes mode. */
+static const struct perf_source {
+  const char*          tracepoint;  /* NULL for a software event */
+  unsigned             sw_config;
+  unsigned             cause;
+} perf_sources[] = {
+  { NULL, PERF_COUNT_SW_CONTEXT_SWITCHES, SJ_CAUSE_SCHED },
+  { NULL, PERF_COUNT_SW_PAGE_FAULTS,      SJ_CAUSE_FAULT },
+  { "irq/irq_handler_entry",         0,   SJ_CAUSE_IRQ },
+  { "irq/softirq_entry",             0,   SJ_CAUSE_SOFTIRQ },
+  { "timer/hrtimer_expire_entry",    0,   SJ_CAUSE_TIMER },
+  { "timer/timer_expire_entry",      0,   SJ_CAUSE_TIMER },
+  { "irq_vectors/local_timer_entry", 0,   SJ_CAUSE_TICK },
+};
+
+#define PERF_N_SOURCES  (sizeof(perf_sources) / sizeof(perf_sources[0]))
+
+/* Slack allowed when matching perf samples to interruptions, to cover
+ * error in converting between the perf clock and frc().
+ */
+#define PERF_SLACK_NS   1000
+
+
+struct perf_sample {
+  stamp_t              ts;
+  unsigned             cause;
+};
+
+
+/* A group of interruptions on different cores that started close together. */
+struct cluster {
+  stamp_t              start;       /* on the housekeeping core's clock */
+  cycles_t             span;        /* first start to last end */
+  cycles_t             max;         /* longest of the interruptions */
+  unsigned             n_cores;
+};
+
+/* --periodicity looks for up to PERIOD_MAX periods on each core, between
+ * a few bins and PERIOD_MAX_NS, using an FFT of at most PERIOD_FFT_N
+ * points.  A period is only reported if at least PERIOD_MIN_EVENTS
+ * interruptions recur at it, making up PERIOD_MIN_SHARE of int_total.
+ */
+#define PERIOD_MAX           3
+#define PERIOD_MAX_NS        2000000000ull
+#define PERIOD_MIN_BIN_NS    20000
+#define PERIOD_FFT_N         (1u << 21)
+#define PERIOD_MIN_EVENTS    10
+#define PERIOD_MIN_SHARE     0.02
+
+struct period {
+  uint64_t             period_ns;
+  double               share;       /* of int_total */
+};
+
+/* Round trips used to measure each core's frc() offset, and how far
+ * (in ticks) beyond its error bound an offset may be before we warn.
+ */
+#define OFFSET_ROUNDS        1000
+#define CLOCK_SKEW_SLACK     100
+#define COINCIDE_WINDOW_NS   10000
+#define COINCIDE_MAX_LISTED  20
+
+
+enum load_kind {
+  LOAD_MEMBW,    /* saturate memory bandwidth */
+  LOAD_SYSCALL,  /* a storm of trivial system calls */
+  LOAD_IO,       /* page-cache reads and writes */
+  LOAD_TLB,      /* mprotect/munmap, causing TLB shootdowns */
+};
+
+static const char* const load_kind_names[] = {
+  "membw", "syscall", "io", "tlb",
+};
+
+/* Buffer sizes for the load generators. */
+#define LOAD_MEMBW_BYTES  (64 << 20)
+#define LOAD_IO_BYTES     (1 << 20)
+#define LOAD_IO_BLOCKS    64
+#define LOAD_TLB_BYTES    (1 << 20)
+
+
+/* One --load option. */
+struct load_spec {
+  const char*          arg;
+  cpu_set_t            cores;
+  enum load_kind       kind;
+};
+
+
+struct load_thread {
+  pthread_t            thread_id;
+  int                  core_i;
+  enum load_kind       kind;
+};
+
+
+enum mem_kind {
+  MEM_DEFAULT,
+  MEM_THP,
+  MEM_HUGETLB
+};
+
+
+#ifndef MPOL_BIND
+# define MPOL_BIND  2
+#endif
+#ifndef SCHED_DEADLINE
+# define SCHED_DEADLINE  6
+#endif
+
+/* As for sched_setattr(2), which glibc may not wrap. */
+struct sj_sched_attr {
+  uint32_t             size;
+  uint32_t             sched_policy;
+  uint64_t             sched_flags;
+  int32_t              sched_nice;
+  uint32_t             sched_priority;
+  uint64_t             sched_runtime;
+  uint64_t             sched_deadline;
+  uint64_t             sched_period;
+};
+
+/* SCHED_DEADLINE reservation for the measuring threads.  Admission
+ * control won't give a thread the whole core, so while spinning they are
+ * throttled for the rest of each period, as a real deadline thread would
+ * be.
+ */
+#define DL_PERIOD_NS   10000000
+#define DL_RUNTIME_NS   9000000
+
+#ifndef MPOL_MF_MOVE
+# define MPOL_MF_MOVE  (1 << 1)
+#endif
+
+
 struct interruption {
   stamp_t   ts;
   cycles_t  diff;
 };
 
+/* Binary raw files are written straight from the interruption arrays. */
+_Static_assert(sizeof(struct interruption) == sizeof(struct sj_raw_record),
+               "struct interruption must match struct sj_raw_record");
+
+
+/* Single-producer single-consumer ring used in streaming mode.  The
+ * measuring thread is the only writer of [head] and the collector thread is
+ * the only writer of [tail], and they live on separate cache lines so the
+ * measuring core only ever pulls in the collector's line when it thinks the
+ * ring is full.
+ */
+struct ring {
+  uint64_t             head __attribute__((aligned(CACHE_LINE)));
+  uint64_t             tail_cache;
+  uint64_t             tail __attribute__((aligned(CACHE_LINE)));
+  uint64_t             mask __attribute__((aligned(CACHE_LINE)));
+  struct interruption  rec[] __attribute__((aligned(CACHE_LINE)));
+};
+
+
+#define BARRIER_MAX_ROUNDS  16
+#define MAX_LOADS           8
+#define MAX_BINS            32
+#define MAX_REGRESS         16
+#define TRIGGER_CONTEXT     16  /* a power of 2 */
+#define TRIGGER_MAX_EVENTS  64
+#define TRIGGER_POLL_MIN_US 1000
+#define TRIGGER_POLL_MAX_US 32000
+#define BASELINE_VERSION    1
+#define THREAD_STACK_BYTES  (256 << 10)
+
+struct barrier_flag {
+  volatile unsigned    episode;
+} __attribute__((aligned(CACHE_LINE)));
+
+
+/* Handed from a measuring thread to the trigger thread.  The measuring
+ * thread only fills it while [full] is clear, and the trigger thread
+ * clears it when done, so neither ever waits.  [n] is only written by the
+ * trigger thread.
+ */
+struct trigger_slot {
+  volatile int         full __attribute__((aligned(CACHE_LINE)));
+  unsigned             n;
+  struct interruption  event;
+  unsigned             n_ctx;
+  struct interruption  ctx[TRIGGER_CONTEXT];
+};
+
+
+/* A --trigger event as kept for the report. */
+struct trigger_event {
+  int                  thread_i;
+  struct trigger_slot  slot;
+};
+
+
+/* Each thread's state gets a page of its own, so that no two threads
+ * share a cache line and the page can be moved to the thread's node.
+ */
+#define THREAD_ALIGN  4096
 
 struct thread {
   int                  core_i;
   pthread_t            thread_id;
 
+  /* Set when the run should end.  On a line of its own, as it is polled
+   * by the measurement loop.
+   */
+  volatile int         stop __attribute__((aligned(CACHE_LINE)));
+
+  /* Dissemination barrier: in round r the thread 2^r places before us
+   * writes the episode it has reached into barrier_flag[r].  Episodes
+   * count up across runs, so the flags never need resetting.
+   */
+  struct barrier_flag  barrier_flag[BARRIER_MAX_ROUNDS];
+  unsigned             barrier_episode;
+
   /* Results generated during a test. */
   unsigned             cpu_mhz;
   struct interruption* interruptions;
@@ -134,19 +393,111 @@ struct thread {
   stamp_t              frc_start;
   stamp_t              frc_stop;
 
-  /* Calculated by post-processing after the test. */
-  struct interruption**sorted;
-  cycles_t             runtime;
+  struct sj_histogram* hist;
+  void*                arena;
+  size_t               arena_bytes;
+
+  char                 sched_policy[16];
+  unsigned             wakeups;
+
+  /* --workload walk: the working set, the time to walk one chunk of it
+   * undisturbed, and the extra time taken after interruptions.
+   */
+  const uint64_t*      walk;
+  cycles_t             walk_iter;
+  cycles_t             recov_total;
+  cycles_t             recov_mean;
+  cycles_t             recov_max;
+  unsigned             recov_n;
+  uint64_t             walk_sink;
+
+  /* --bins: gaps of at least bin_edge[b] (and less than the next edge)
+   * are counted in bin_n[b].
+   */
+  cycles_t             bin_edge[MAX_BINS];
+  uint64_t             bin_n[MAX_BINS];
+  uint8_t              bin_lut[64];
+  unsigned             n_bins;
+
+  /* --trigger: the last interruptions seen, for context, and where an
+   * interruption of at least trigger_cycles is passed on.  Zero when
+   * there is no trigger.
+   */
+  cycles_t             trigger_cycles;
+  unsigned             trigger_ctx_n;
+  unsigned             trigger_missed;
+  struct interruption  trigger_ctx[TRIGGER_CONTEXT];
+  struct trigger_slot  trigger_slot;
+
+  /* Period of the measurement loop, measured before the run. */
+  cycles_t             loop_min;
+  cycles_t             loop_median;
+
+  /* Offset of this core's frc() from the housekeeping core's, and the
+   * uncertainty in it.
+   */
+  int64_t              frc_offset;
+  cycles_t             frc_offset_err;
+  /* With --clock rdtscp, interruptions after which we were elsewhere. */
+  unsigned             clock_migrations;
+  unsigned             int_coincident;
+  struct period        periods[PERIOD_MAX];
+  unsigned             n_periods;
+
+  /* Time the hypervisor gave this vCPU to others during the run. */
+  uint64_t             steal_start;
+  uint64_t             steal;
+
+  /* --msr: SMI count and APERF/MPERF, read at start and stop. */
+  int                  msr_fd;
+  uint64_t             msr_start[3];
+  unsigned             smi_count;
+  unsigned             eff_mhz;
+
+  /* perf_event cause capture. */
+  int                  perf_n;
+  int                  perf_fd[PERF_N_SOURCES];
+  uint64_t             perf_id[PERF_N_SOURCES];
+  unsigned             perf_cause[PERF_N_SOURCES];
+  struct perf_event_mmap_page* perf_ring;
+  uint64_t             mono_start;
+  uint64_t             mono_stop;
+  uint32_t*            causes;
+  unsigned             cause_n[SJ_N_CAUSES];
+  unsigned             cause_none;
+  uint64_t             perf_lost;
+
+  /* Streaming mode. */
+  struct ring*         ring;
+  unsigned             ring_dropped;
+  FILE*                stream_f;
+  size_t               gather_cap;
+  stamp_t              stream_prev_ts;
+  unsigned             stream_n;
+
   unsigned             int_n;
   cycles_t             int_min;
   cycles_t             int_max;
-  cycles_t             int_mean;
-  cycles_t             int_median;
-  cycles_t             int_90;
-  cycles_t             int_99;
-  cycles_t             int_999;
-  cycles_t             int_9999;
-  cycles_t             int_99999;
+
+  /* Calculated by post-processing after the test. */
+  struct interruption* sorted;
+  cycles_t             runtime;
+  struct sj_stats      stats;
+} __attribute__((aligned(THREAD_ALIGN)));
+
+
+/* What --trials keeps of each core's run. */
+struct trial_result {
+  double               int_99_ns;
+  double               int_9999_ns;
+  double               int_total_pc;
+};
+
+
+struct regress_limit {
+  int                  metric;
+  double               limit;
+  int                  relative;
 };
 
 
@@ -159,17 +510,128 @@ struct global {
   struct timeval        tv_start;
   int                   sort_raw;
   int                   verbose;
+  int                   housekeeping_core;
+  int                   calibrate;
+  unsigned              cpu_mhz;
+  struct thread*        threads;
+
+  /* --raw and --stream. */
+  const char*           raw_prefix;
+  int                   raw_bin;
+  int                   store_raw;
+  int                   gather;
+  int                   keep_raw;
+  int                   stream;
+  unsigned              ring_size;
+  int                   raw_core_digits;
 
-  /* Mutable state. */
-  volatile enum command cmd;
-  volatile unsigned     n_threads_started;
-  volatile unsigned     n_threads_ready;
-  volatile unsigned     n_threads_running;
-  volatile unsigned     n_threads_finished;
+  /* --mem, --mlock and --rt-policy. */
+  enum mem_kind         mem;
+  size_t                huge_page_size;
+  size_t                page_size;
+  int                   mlock;
+  int                   rt_policy;
+  int                   rt_prio;
+
+  /* What is measured: --loop, --clock, --mode, --workload and --bins. */
+  const struct loop_variant* loop;
+  int                   clock;
+  int                   measure_offsets;
+  int                   wakeup;
+  unsigned              wakeup_period_usec;
+  size_t                walk_bytes;
+  unsigned              bin_ns[MAX_BINS];
+  unsigned              n_bins;
+
+  /* --interval and --daemon. */
+  double                interval_secs;
+  FILE*                 interval_f;
+  int                   interval_quiet;
+  int                   daemon;
+  struct sj_shm_header* shm;
+  size_t                shm_bytes;
+
+  /* --attribute, --perf-causes and --msr. */
+  int                   attribute;
+  struct counters       attr_start;
+  struct counters       attr_stop;
+  double                attr_secs;
+  int                   perf;
+  unsigned              perf_pages;
+  uint64_t              perf_tp_id[PERF_N_SOURCES];
+  int                   msr;
+  int                   msr_no_smi;
+
+  /* --load. */
+  struct load_spec      loads[MAX_LOADS];
+  unsigned              n_loads;
+  struct load_thread*   load_threads;
+  unsigned              n_load_threads;
+  int                   loading;
+
+  /* --trials, --save-baseline and --compare. */
+  unsigned              n_trials;
+  double                trial_gap_secs;
+  struct trial_result*  trial_results;
+  const char*           baseline_save;
+  const char*           baseline_compare;
+  struct regress_limit  regress[MAX_REGRESS];
+  unsigned              n_regress;
+
+  /* --coincidence and --periodicity. */
+  unsigned              coincide_k;
+  unsigned              coincide_window_nsec;
+  struct cluster*       clusters;
+  unsigned              n_clusters;
+  int                   periodicity;
+
+  /* Running in a VM. */
+  const char*           hypervisor;
+  int                   show_steal;
+
+  /* --trigger. */
+  unsigned              trigger_nsec;
+  int                   trigger_stop;
+  int                   trace_marker_fd;
+  int                   tracing_on_fd;
+  struct trigger_event  trigger_events[TRIGGER_MAX_EVENTS];
+  unsigned              n_trigger_events;
+  volatile int          trigger_run;
+
+#ifdef SYSJITTER_MPI
+  int                   mpi_rank;
+  int                   mpi_size;
+  /* Worst interruption on this node in each --interval window. */
+  uint64_t*             window_max_ns;
+  unsigned              n_windows;
+  unsigned              n_windows_done;
+#endif
+
+  /* Whether this is the calibration run, and whether the measuring
+   * threads post-process their own results.
+   */
+  int                   calibrating;
+  int                   post_in_threads;
+
+  /* Mutable state.  Each of these is hit by all threads at once at some
+   * point, so they get a cache line each.
+   */
+  volatile enum command cmd __attribute__((aligned(CACHE_LINE)));
+  volatile unsigned     n_threads_started __attribute__((aligned(CACHE_LINE)));
+  volatile int          collector_run __attribute__((aligned(CACHE_LINE)));
+  volatile int          measure_done;
+  volatile int          load_stop;
+  volatile int          overflow;
+  int                   raw_err;
+  int                   reporter_run;
+  pthread_mutex_t       reporter_lock;
+  pthread_cond_t        reporter_cond;
 };
 
 
-static struct global g;
+static struct global g = {
+  .reporter_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 
 #define TEST(x)                                 \
@@ -191,212 +653,1231 @@ static void test_fail(const char* what, int line)
 }
 
 
-static int move_to_core(int core_i)
+static const char* policy_name(int policy)
 {
-  cpu_set_t cpus;
-  CPU_ZERO(&cpus);
-  CPU_SET(core_i, &cpus);
-  return sched_setaffinity(0, sizeof(cpus), &cpus);
+  switch( policy ) {
+  case SCHED_FIFO:      return "fifo";
+  case SCHED_RR:        return "rr";
+  case SCHED_DEADLINE:  return "deadline";
+  case SCHED_OTHER:     return "other";
+  default:              return "?";
+  }
 }
 
 
-static cycles_t __measure_cpu_hz(void)
+/* Puts the calling thread in the --rt-policy scheduling class. */
+static int set_rt_sched(int policy, int prio)
 {
-  struct timeval tvs, tve;
-  stamp_t s, e;
-  double sec;
+  struct sj_sched_attr attr;
+  struct sched_param sp;
 
-  frc(&s);
-  e = s;
-  gettimeofday(&tvs, NULL);
-  while( e - s < 1000000 )
-    frc(&e);
-  gettimeofday(&tve, NULL);
-  sec = tve.tv_sec - tvs.tv_sec + (tve.tv_usec - tvs.tv_usec) / 1e6;
-  return (cycles_t) ((e - s) / sec);
+  if( policy != SCHED_DEADLINE ) {
+    sp.sched_priority = prio;
+    return pthread_setschedparam(pthread_self(), policy, &sp);
+  }
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sched_policy = SCHED_DEADLINE;
+  attr.sched_runtime = DL_RUNTIME_NS;
+  attr.sched_deadline = DL_PERIOD_NS;
+  attr.sched_period = DL_PERIOD_NS;
+  return syscall(SYS_sched_setattr, 0, &attr, 0) == 0 ? 0 : errno;
 }
 
 
-static unsigned measure_cpu_mhz(void)
+/* Our threads need little stack, and with --mlock all of it is locked,
+ * so don't give them the default (often 8MB).
+ */
+static void start_thread(pthread_t* tid, void* (*fn)(void*), void* arg)
 {
-  cycles_t m, mprev, d;
-
-  mprev = __measure_cpu_hz();
-  do {
-    m = __measure_cpu_hz();
-    if( m > mprev )  d = m - mprev;
-    else             d = mprev - m;
-    mprev = m;
-  } while( d > m / 1000 );
+  pthread_attr_t attr;
 
-  return (unsigned) (m / 1000000);
+  TEST0(pthread_attr_init(&attr));
+  TEST0(pthread_attr_setstacksize(&attr, THREAD_STACK_BYTES));
+  TEST0(pthread_create(tid, &attr, fn, arg));
+  TEST0(pthread_attr_destroy(&attr));
 }
 
 
-static void thread_init(struct thread* t)
+static int move_to_core(int core_i)
 {
-  int bytes = g.max_interruptions * sizeof(struct interruption);
-  TEST(t->interruptions = malloc(bytes));
-  memset(t->interruptions, 0, bytes);  /* touch to fault in */
-  t->c_interruption = t->interruptions;
-  TEST(t->sorted = malloc(g.max_interruptions * sizeof(t->sorted[0])));
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core_i, &cpus);
+  return sched_setaffinity(0, sizeof(cpus), &cpus);
 }
 
 
-static uint64_t cycles_to_ns(const struct thread* t, uint64_t cycles)
+static size_t read_huge_page_size(void)
 {
-  return cycles * 1000 / t->cpu_mhz;
-}
-
+  size_t kb = 0;
+  char line[128];
+  FILE* f;
 
-static uint64_t cycles_to_us(const struct thread* t, uint64_t cycles)
-{
-  return cycles / t->cpu_mhz;
+  if( (f = fopen("/proc/meminfo", "r")) != NULL ) {
+    while( fgets(line, sizeof(line), f) )
+      if( sscanf(line, "Hugepagesize: %zu kB", &kb) == 1 )
+        break;
+    fclose(f);
+  }
+  return kb ? kb * 1024 : 2 * 1024 * 1024;
 }
 
 
-static float cycles_to_sec_f(const struct thread* t, uint64_t cycles)
+/* Bind [p] to the numa node of the core we're running on.  Must be done
+ * before the memory is faulted in.
+ */
+static void bind_local(void* p, size_t bytes, unsigned flags)
 {
-  return cycles / (t->cpu_mhz * 1e6);
+  unsigned long nodemask[4] = { 0 };
+  unsigned cpu, node;
+
+  if( syscall(SYS_getcpu, &cpu, &node, NULL) != 0 ||
+      node >= sizeof(nodemask) * 8 )
+    return;
+  nodemask[node / (sizeof(long) * 8)] |= 1ul << (node % (sizeof(long) * 8));
+  if( syscall(SYS_mbind, p, bytes, MPOL_BIND, nodemask,
+              sizeof(nodemask) * 8 + 1, flags) != 0 && g.verbose )
+    fprintf(stderr, "%s: WARNING: mbind failed on core %u (%s)\n",
+            APP_NAME, cpu, strerror(errno));
 }
 
 
-static void doit(struct thread* t, cycles_t threshold_cycles)
+/* Allocate memory for a measuring thread, placed according to --mem and
+ * faulted in so that we don't take page faults while measuring.  Must be
+ * called on the thread's own core.
+ */
+static void* buf_alloc(size_t* bytes)
 {
-  struct interruption* i = t->interruptions;
-  struct interruption* i_end = t->interruptions + g.max_interruptions;
-  stamp_t prev_ts;
-  cycles_t int_total = 0;
+  size_t align = g.huge_page_size;
+  char* p;
 
-  frc(&prev_ts);
-  while( g.cmd == GO ) {
-    frc(&i->ts);
-    i->diff = i->ts - prev_ts;
-    prev_ts = i->ts;
-    if( i->diff >= threshold_cycles ) {
-      int_total += i->diff;
-      ++i;
-      if( i == i_end )
-        break;
+  switch( g.mem ) {
+  case MEM_HUGETLB:
+    /* Not MAP_POPULATE, as we want to bind before the pages are chosen. */
+    *bytes = (*bytes + align - 1) & ~(align - 1);
+    p = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if( p == MAP_FAILED ) {
+      fprintf(stderr, "%s: ERROR: Could not allocate %zu bytes of huge pages "
+              "(%s)\n", APP_NAME, *bytes, strerror(errno));
+      fprintf(stderr, "%s: See /proc/sys/vm/nr_hugepages\n", APP_NAME);
+      exit(1);
     }
+    bind_local(p, *bytes, 0);
+    break;
+  case MEM_THP:
+    /* Over-allocate so we can trim to a huge page boundary. */
+    *bytes = (*bytes + align - 1) & ~(align - 1);
+    TEST((p = mmap(NULL, *bytes + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+    {
+      char* aligned = (char*) (((uintptr_t) p + align - 1) & ~(align - 1));
+      if( aligned != p )
+        munmap(p, aligned - p);
+      munmap(aligned + *bytes, p + align - aligned);
+      p = aligned;
+    }
+    if( madvise(p, *bytes, MADV_HUGEPAGE) != 0 )
+      fprintf(stderr, "%s: WARNING: madvise(MADV_HUGEPAGE) failed (%s)\n",
+              APP_NAME, strerror(errno));
+    bind_local(p, *bytes, 0);
+    break;
+  default:
+    TEST0(posix_memalign((void**) &p, CACHE_LINE, *bytes));
+    break;
   }
+  memset(p, 0, *bytes);  /* touch to fault in */
+  return p;
+}
 
-  t->c_interruption = i;
-  t->int_total = int_total;
+
+static void buf_free(void* p, size_t bytes)
+{
+  if( p == NULL )
+    return;
+  if( g.mem == MEM_DEFAULT )
+    free(p);
+  else
+    munmap(p, bytes);
 }
 
 
-static void* thread_main(void* arg)
+#define ALIGN_UP(x)  (((x) + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1))
+
+
+static void thread_init(struct thread* t)
 {
-  /* Important thing to note here is that once we start bashing the CPU, we
-   * need to keep doing so to prevent the core from changing frequency or
-   * dropping into a low power state.
+  size_t hist_off = 0, ring_off, ints_off, walk_off, bytes;
+  char* p;
+
+  /* Everything the thread touches while measuring comes from one
+   * allocation, so with huge pages it needs as few TLB entries as
+   * possible.
    */
-  struct thread* t = arg;
+  ring_off = ALIGN_UP(hist_off + sizeof(*t->hist));
+  ints_off = ring_off;
+  if( g.stream )
+    ints_off += ALIGN_UP(sizeof(*t->ring) + g.ring_size *
+                         sizeof(t->ring->rec[0]));
+  bytes = ints_off;
+  if( g.store_raw )
+    bytes += g.max_interruptions * sizeof(struct interruption);
+  walk_off = ALIGN_UP(bytes);
+  bytes = walk_off + g.walk_bytes;
 
-  /* Alloc memory in the thread itself after setting affinity to get the
-   * best chance of getting numa-local memory.  Doesn't matter so much for
-   * the "struct thread" since we expect that to stay cache resident.
+  /* Later --trials keep the arena of the first, with the same layout, so
+   * only the histogram and ring indices need clearing.
    */
-  TEST(move_to_core(t->core_i) == 0);
-  thread_init(t);
+  if( t->arena != NULL ) {
+    p = t->arena;
+    memset(p + hist_off, 0, sizeof(*t->hist));
+    if( g.stream )
+      memset(p + ring_off, 0, sizeof(*t->ring));
+  }
+  else {
+    t->arena_bytes = bytes;
+    t->arena = p = buf_alloc(&(t->arena_bytes));
+  }
+  t->hist = (void*) (p + hist_off);
+  t->ring = NULL;
+  t->interruptions = t->c_interruption = NULL;
+  t->sorted = NULL;
+  t->stop = 0;
+  t->perf_n = 0;
+  t->perf_ring = NULL;
+  t->causes = NULL;
+  t->perf_lost = 0;
+  t->trigger_cycles = 0;
+  t->trigger_ctx_n = 0;
+  t->trigger_missed = 0;
+  t->trigger_slot.n = 0;
+  t->trigger_slot.full = 0;
 
-  /* Don't bash the cpu until all threads have got going. */
-  atomic_inc(&g.n_threads_started);
-  while( g.cmd == WAIT )
-    usleep(1000);
+  if( g.stream ) {
+    t->ring = (void*) (p + ring_off);
+    t->ring->mask = g.ring_size - 1;
+  }
+  if( g.store_raw ) {
+    t->interruptions = (void*) (p + ints_off);
+    t->c_interruption = t->interruptions;
+  }
+  t->walk = g.walk_bytes ? (void*) (p + walk_off) : NULL;
+}
 
-  t->cpu_mhz = measure_cpu_mhz();
 
-  /* Ensure we all start at the same time. */
-  atomic_inc(&g.n_threads_running);
-  while( g.n_threads_running != g.n_threads )
-    relax();
+static uint64_t mono_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  frc(&t->frc_start);
-  doit(t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000);
-  frc(&t->frc_stop);
 
-  /* Wait for everyone to finish so we don't disturb them by exiting and
-   * waking the main thread.
-   */
-  atomic_inc(&g.n_threads_finished);
-  while( g.n_threads_finished != g.n_threads )
-    relax();
+/* Find the ids of the tracepoints we want.  Missing ones are skipped. */
+static void perf_find_tracepoints(void)
+{
+  static const char* const roots[] = {
+    "/sys/kernel/tracing/events", "/sys/kernel/debug/tracing/events",
+  };
+  char path[256];
+  unsigned k, r;
+  FILE* f;
 
-  return NULL;
+  for( k = 0; k < PERF_N_SOURCES; ++k ) {
+    if( perf_sources[k].tracepoint == NULL )
+      continue;
+    for( r = 0; r < sizeof(roots) / sizeof(roots[0]); ++r ) {
+      snprintf(path, sizeof(path), "%s/%s/id",
+               roots[r], perf_sources[k].tracepoint);
+      if( (f = fopen(path, "r")) == NULL )
+        continue;
+      if( fscanf(f, "%"SCNu64, &g.perf_tp_id[k]) != 1 )
+        g.perf_tp_id[k] = 0;
+      fclose(f);
+      break;
+    }
+    if( g.perf_tp_id[k] == 0 && g.verbose )
+      fprintf(stderr, "%s: WARNING: tracepoint %s not available\n",
+              APP_NAME, perf_sources[k].tracepoint);
+  }
 }
 
 
-static int qsort_cmp_interruption(const void* oa, const void* ob)
+/* Open the perf events for this thread's core, all feeding one ring that
+ * the kernel writes and that we only read after the run.  Per-cpu events
+ * see everything that runs on the core, but need privilege, so we fall
+ * back to events that follow just this thread.
+ */
+static void perf_open(struct thread* t)
 {
-  const struct interruption*const* a = oa;
-  const struct interruption*const* b = ob;
-  return (int) ((*a)->diff - (*b)->diff);
+  struct perf_event_attr attr;
+  size_t ring_bytes = (g.perf_pages + 1) * g.page_size;
+  int k, fd, pid = -1, cpu = t->core_i;
+  void* p;
+
+  t->perf_n = 0;
+  for( k = 0; k < PERF_N_SOURCES; ++k ) {
+    if( perf_sources[k].tracepoint != NULL && g.perf_tp_id[k] == 0 )
+      continue;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    if( perf_sources[k].tracepoint != NULL ) {
+      attr.type = PERF_TYPE_TRACEPOINT;
+      attr.config = g.perf_tp_id[k];
+    }
+    else {
+      attr.type = PERF_TYPE_SOFTWARE;
+      attr.config = perf_sources[k].sw_config;
+    }
+    attr.sample_period = 1;
+    attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TIME;
+    attr.disabled = 1;
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC;
+    /* Nobody polls the ring, so avoid wakeups until it is full. */
+    attr.watermark = 1;
+    attr.wakeup_watermark = g.perf_pages * g.page_size;
+
+    fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+    if( fd < 0 && t->perf_n == 0 && pid == -1 ) {
+      pid = 0;
+      cpu = -1;
+      fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+    }
+    if( fd < 0 ) {
+      if( g.verbose )
+        fprintf(stderr, "%s: WARNING: perf_event_open(%s) failed on core %d "
+                "(%s)\n", APP_NAME, perf_sources[k].tracepoint ?
+                perf_sources[k].tracepoint : "software", t->core_i,
+                strerror(errno));
+      continue;
+    }
+    if( t->perf_n == 0 ) {
+      p = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if( p == MAP_FAILED ) {
+        fprintf(stderr, "%s: ERROR: Could not map perf ring on core %d (%s)\n",
+                APP_NAME, t->core_i, strerror(errno));
+        close(fd);
+        return;
+      }
+      t->perf_ring = p;
+    }
+    else if( ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, t->perf_fd[0]) != 0 ) {
+      close(fd);
+      continue;
+    }
+    TEST0(ioctl(fd, PERF_EVENT_IOC_ID, &(t->perf_id[t->perf_n])));
+    t->perf_cause[t->perf_n] = perf_sources[k].cause;
+    t->perf_fd[t->perf_n++] = fd;
+  }
+  if( t->perf_n == 0 )
+    fprintf(stderr, "%s: WARNING: No perf events could be opened on core %d "
+            "(see /proc/sys/kernel/perf_event_paranoid)\n",
+            APP_NAME, t->core_i);
 }
 
 
-static void unsort_interruptions(struct thread* t)
+static void perf_enable(struct thread* t, int enable)
 {
-  int i, n = t->c_interruption - t->interruptions;
-  for( i = 0; i < n; ++i )
-    t->sorted[i] = &t->interruptions[i];
+  int k;
+  for( k = 0; k < t->perf_n; ++k )
+    ioctl(t->perf_fd[k], enable ? PERF_EVENT_IOC_ENABLE :
+          PERF_EVENT_IOC_DISABLE, 0);
 }
 
 
-static void sort_interruptions(struct thread* t)
+static void perf_close(struct thread* t)
 {
-  int n = t->c_interruption - t->interruptions;
-  unsort_interruptions(t);
-  qsort(t->sorted, n, sizeof(t->sorted[0]), qsort_cmp_interruption);
+  int k;
+  for( k = 0; k < t->perf_n; ++k )
+    close(t->perf_fd[k]);
+  if( t->perf_ring != NULL )
+    munmap(t->perf_ring, (g.perf_pages + 1) * g.page_size);
+  t->perf_ring = NULL;
+  t->perf_n = 0;
+  free(t->causes);
+  t->causes = NULL;
 }
 
 
-static void thread_calc_stats(struct thread* t)
+/* Pull the samples out of the ring, converting their timestamps to frc()
+ * ticks.  Returns the number of samples.
+ */
+static size_t perf_read(struct thread* t, struct perf_sample** samples_out)
 {
-  struct interruption* i;
-  uint64_t sum;
+  struct perf_event_mmap_page* mp = t->perf_ring;
+  const char* data = (const char*) mp + g.page_size;
+  uint64_t size = (uint64_t) g.perf_pages * g.page_size;
+  uint64_t head = __atomic_load_n(&mp->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = mp->data_tail, off, rec[4];
+  struct perf_sample* samples = NULL;
+  struct perf_event_header hdr;
+  size_t n = 0, cap = 0, len, k;
+  double cycles_per_ns;
 
-  t->runtime = t->frc_stop - t->frc_start;
-  t->int_n = t->c_interruption - t->interruptions;
-  if( t->int_n ) {
-    sort_interruptions(t);
-    t->int_min = t->sorted[0]->diff;
-    t->int_max = t->sorted[t->int_n - 1]->diff;
-    t->int_median = t->sorted[t->int_n / 2]->diff;
-    t->int_90 = t->sorted[(int) (t->int_n * 0.9)]->diff;
-    t->int_99 = t->sorted[(int) (t->int_n * 0.99)]->diff;
-    t->int_999 = t->sorted[(int) (t->int_n * 0.999)]->diff;
-    t->int_9999 = t->sorted[(int) (t->int_n * 0.9999)]->diff;
-    t->int_99999 = t->sorted[(int) (t->int_n * 0.99999)]->diff;
-    sum = 0;
-    for( i = t->interruptions; i != t->c_interruption; ++i )
-      sum += i->diff;
-    t->int_mean = sum / t->int_n;
-  }
-  else {
-    t->int_min = 0;
-    t->int_max = 0;
-    t->int_median = 0;
-    t->int_90 = 0;
-    t->int_99 = 0;
-    t->int_999 = 0;
-    t->int_9999 = 0;
-    t->int_99999 = 0;
-    t->int_mean = 0;
+  cycles_per_ns = (double) (t->frc_stop - t->frc_start) /
+    (t->mono_stop - t->mono_start);
+  while( tail < head ) {
+    off = tail % size;
+    memcpy(&hdr, data + off, sizeof(hdr));
+    /* Copy out what we need of the body, which may wrap. */
+    len = hdr.size - sizeof(hdr);
+    if( len > sizeof(rec) )
+      len = sizeof(rec);
+    for( k = 0; k < len; ++k )
+      ((char*) rec)[k] = data[(off + sizeof(hdr) + k) % size];
+    tail += hdr.size;
+    if( hdr.size == 0 )
+      break;
+    if( hdr.type == PERF_RECORD_LOST ) {
+      t->perf_lost += rec[1];
+      continue;
+    }
+    if( hdr.type != PERF_RECORD_SAMPLE || len < 2 * sizeof(uint64_t) ||
+        rec[1] < t->mono_start )
+      continue;
+    if( n == cap ) {
+      cap = cap ? cap * 2 : 4096;
+      TEST(samples = realloc(samples, cap * sizeof(samples[0])));
+    }
+    samples[n].ts = t->frc_start +
+      (stamp_t) ((rec[1] - t->mono_start) * cycles_per_ns);
+    samples[n].cause = 0;
+    for( k = 0; k < t->perf_n; ++k )
+      if( t->perf_id[k] == rec[0] )
+        samples[n].cause = t->perf_cause[k];
+    ++n;
   }
+  __atomic_store_n(&mp->data_tail, tail, __ATOMIC_RELEASE);
+  *samples_out = samples;
+  return n;
 }
 
 
-static void post_test_checks(struct thread* threads)
+/* Give each kept interruption the set of causes seen during it. */
+static void perf_match(struct thread* t)
 {
-  struct thread* t;
-  int early = 0;
-  int i;
+  size_t n_int = t->c_interruption - t->interruptions, n, i, j, jj;
+  struct perf_sample* s;
+  cycles_t slack = (cycles_t) PERF_SLACK_NS * t->cpu_mhz / 1000;
+  const struct interruption* in;
+  stamp_t start, end;
+  uint32_t mask;
+  int b;
 
-  for( i = 0; i < g.n_threads; ++i ) {
-    t = &(threads[i]);
-    if( t->c_interruption - t->interruptions == g.max_interruptions ) {
+  memset(t->cause_n, 0, sizeof(t->cause_n));
+  t->cause_none = 0;
+  if( t->perf_ring == NULL )
+    return;
+  n = perf_read(t, &s);
+  TEST(t->causes = malloc((n_int ? n_int : 1) * sizeof(t->causes[0])));
+
+  /* Both are in time order, so a single pass will do. */
+  for( i = 0, j = 0; i < n_int; ++i ) {
+    in = &(t->interruptions[i]);
+    start = in->ts - in->diff - slack;
+    end = in->ts + slack;
+    while( j < n && s[j].ts < start )
+      ++j;
+    for( mask = 0, jj = j; jj < n && s[jj].ts <= end; ++jj )
+      mask |= s[jj].cause;
+    t->causes[i] = mask;
+    if( mask == 0 )
+      ++(t->cause_none);
+    for( b = 0; b < SJ_N_CAUSES; ++b )
+      if( mask & (1u << b) )
+        ++(t->cause_n[b]);
+  }
+  free(s);
+}
+
+
+/* Cause mask of the kept interruption with timestamp [ts]. */
+static uint32_t cause_of(const struct thread* t, stamp_t ts)
+{
+  size_t lo = 0, hi = t->c_interruption - t->interruptions, mid;
+
+  while( lo < hi ) {
+    mid = (lo + hi) / 2;
+    if( t->interruptions[mid].ts < ts )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return t->causes[lo];
+}
+
+
+/* MSRs read with --msr, in the order they are kept. */
+#define MSR_SMI_COUNT   0x34
+#define MSR_IA32_MPERF  0xe7
+#define MSR_IA32_APERF  0xe8
+
+static const unsigned msr_regs[3] = {
+  MSR_SMI_COUNT, MSR_IA32_APERF, MSR_IA32_MPERF,
+};
+
+
+/* The MSRs are read by the measuring thread itself, as reading another
+ * core's MSRs sends it an IPI.
+ */
+static void msr_open(struct thread* t)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/dev/cpu/%d/msr", t->core_i);
+  if( (t->msr_fd = open(path, O_RDONLY)) < 0 ) {
+    fprintf(stderr, "%s: ERROR: Could not open '%s' (%s)\n",
+            APP_NAME, path, strerror(errno));
+    fprintf(stderr, "%s: ERROR: Try 'modprobe msr' and running as root\n",
+            APP_NAME);
+    exit(2);
+  }
+}
+
+
+static void msr_read(struct thread* t, uint64_t* vals)
+{
+  int k;
+
+  for( k = 0; k < 3; ++k )
+    if( pread(t->msr_fd, &(vals[k]), sizeof(vals[k]), msr_regs[k]) !=
+        sizeof(vals[k]) ) {
+      /* Not all CPUs have MSR_SMI_COUNT (AMD doesn't). */
+      if( msr_regs[k] == MSR_SMI_COUNT )
+        g.msr_no_smi = 1;
+      vals[k] = 0;
+    }
+}
+
+
+static void msr_stop(struct thread* t)
+{
+  uint64_t vals[3], mperf;
+
+  msr_read(t, vals);
+  close(t->msr_fd);
+  t->smi_count = vals[0] - t->msr_start[0];
+  mperf = vals[2] - t->msr_start[2];
+  t->eff_mhz = mperf ?
+    (unsigned) ((double) t->cpu_mhz * (vals[1] - t->msr_start[1]) / mperf) : 0;
+}
+
+
+static uint64_t cycles_to_ns(const struct thread* t, uint64_t cycles)
+{
+  return cycles * 1000 / t->cpu_mhz;
+}
+
+
+static uint64_t cycles_to_us(const struct thread* t, uint64_t cycles)
+{
+  return cycles / t->cpu_mhz;
+}
+
+
+static float cycles_to_sec_f(const struct thread* t, uint64_t cycles)
+{
+  return cycles / (t->cpu_mhz * 1e6);
+}
+
+
+/* Hands the interruption that fired the trigger, and those before it, to
+ * the trigger thread.  If it has not yet dealt with the last one, this
+ * one is only counted.
+ */
+static void __attribute__((noinline, cold)) trigger_fire(struct thread* t)
+{
+  struct trigger_slot* s = &(t->trigger_slot);
+  unsigned k, n = t->trigger_ctx_n;
+
+  if( __atomic_load_n(&s->full, __ATOMIC_ACQUIRE) ) {
+    ++(t->trigger_missed);
+    return;
+  }
+  s->event = t->trigger_ctx[(n - 1) & (TRIGGER_CONTEXT - 1)];
+  s->n_ctx = n - 1 < TRIGGER_CONTEXT ? n - 1 : TRIGGER_CONTEXT - 1;
+  for( k = 0; k < s->n_ctx; ++k )
+    s->ctx[k] = t->trigger_ctx[(n - 1 - s->n_ctx + k) & (TRIGGER_CONTEXT - 1)];
+  __atomic_store_n(&s->full, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Called for each interruption when --trigger is on.  No syscalls, as
+ * we're on the measured core.
+ */
+static inline void trigger_note(struct thread* t, stamp_t ts, cycles_t diff)
+{
+  struct interruption* c;
+
+  c = &(t->trigger_ctx[t->trigger_ctx_n++ & (TRIGGER_CONTEXT - 1)]);
+  c->ts = ts;
+  c->diff = diff;
+  if( diff >= t->trigger_cycles )
+    trigger_fire(t);
+}
+
+
+/* Reads the --clock timestamp source.  In the loops [clock] is a constant,
+ * so this comes down to the one instruction.
+ */
+static inline __attribute__((always_inline))
+void clk_read(int clock, stamp_t* ts, unsigned* aux)
+{
+  switch( clock ) {
+#if defined(__x86_64__) || defined(__i386__)
+  case SJ_CLOCK_RDTSCP:
+    sj_frc_rdtscp(ts, aux);
+    break;
+  case SJ_CLOCK_LFENCE_RDTSC:
+    sj_frc_lfence(ts);
+    break;
+#elif defined(__aarch64__)
+  case SJ_CLOCK_ISB_CNTVCT:
+    sj_frc_isb(ts);
+    break;
+#endif
+  case SJ_CLOCK_CLOCK_GETTIME:
+    *ts = mono_ns();
+    break;
+  default:
+    sj_frc(ts);
+    break;
+  }
+}
+
+
+/* For timestamps outside the loops that are compared with theirs. */
+static void frc(stamp_t* ts)
+{
+  unsigned aux;
+  clk_read(g.clock, ts, &aux);
+}
+
+
+static void doit(struct thread* t, cycles_t threshold_cycles)
+{
+  struct interruption* i = t->interruptions;
+  struct interruption* i_end = t->interruptions + g.max_interruptions;
+  uint64_t* counts = t->hist->counts;
+  stamp_t prev_ts;
+  cycles_t int_total = 0, int_min = (cycles_t) -1, int_max = 0;
+
+  sj_frc(&prev_ts);
+  while( ! t->stop ) {
+    sj_frc(&i->ts);
+    i->diff = i->ts - prev_ts;
+    prev_ts = i->ts;
+    if( i->diff >= threshold_cycles ) {
+      int_total += i->diff;
+      sj_hist_inc(counts, i->diff);
+      if( i->diff < int_min )
+        int_min = i->diff;
+      if( i->diff > int_max )
+        int_max = i->diff;
+      if( t->trigger_cycles )
+        trigger_note(t, i->ts, i->diff);
+      ++i;
+      if( i == i_end )
+        break;
+    }
+  }
+
+  t->c_interruption = i;
+  t->int_total = int_total;
+  t->int_n = i - t->interruptions;
+  t->int_min = t->int_n ? int_min : 0;
+  t->int_max = int_max;
+}
+
+
+static inline int ring_push(struct ring* r, stamp_t ts, cycles_t diff)
+{
+  uint64_t head = r->head;
+  struct interruption* i;
+
+  if( head - r->tail_cache > r->mask ) {
+    r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if( head - r->tail_cache > r->mask )
+      return 0;
+  }
+  i = &(r->rec[head & r->mask]);
+  i->ts = ts;
+  i->diff = diff;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+/* As doit(), but interruptions are not stored, so memory use does not
+ * depend on the runtime.  In streaming mode they are handed to the
+ * collector through the ring.  If the collector falls behind we drop
+ * records rather than stall, but they still count towards the summary.
+ */
+static void doit_unstored(struct thread* t, cycles_t threshold_cycles)
+{
+  struct ring* r = t->ring;
+  uint64_t* counts = t->hist->counts;
+  stamp_t prev_ts, now;
+  cycles_t diff, int_total = 0, int_min = (cycles_t) -1, int_max = 0;
+  unsigned int_n = 0, dropped = 0;
+
+  sj_frc(&prev_ts);
+  while( ! t->stop ) {
+    sj_frc(&now);
+    diff = now - prev_ts;
+    prev_ts = now;
+    if( diff >= threshold_cycles ) {
+      int_total += diff;
+      ++int_n;
+      sj_hist_inc(counts, diff);
+      if( diff < int_min )
+        int_min = diff;
+      if( diff > int_max )
+        int_max = diff;
+      if( t->trigger_cycles )
+        trigger_note(t, now, diff);
+      if( r != NULL && ! ring_push(r, now, diff) )
+        ++dropped;
+    }
+  }
+
+  t->int_total = int_total;
+  t->int_n = int_n;
+  t->int_min = int_n ? int_min : 0;
+  t->int_max = int_max;
+  t->ring_dropped = dropped;
+}
+
+
+/* Counts a gap of at least bin_edge[0] in its --bins bin.  The lookup
+ * table gives the number of edges at or below the gap's power of 2, so
+ * at most a few more edges need comparing.
+ */
+static inline void bin_count(struct thread* t, cycles_t diff)
+{
+  unsigned b = t->bin_lut[63 - __builtin_clzll(diff)];
+  while( b < t->n_bins && t->bin_edge[b] <= diff )
+    ++b;
+  ++(t->bin_n[b - 1]);
+}
+
+
+/* Converts the --bins edges to this thread's ticks. */
+static void bins_init(struct thread* t)
+{
+  unsigned b, o;
+
+  t->n_bins = g.n_bins;
+  for( b = 0; b < g.n_bins; ++b ) {
+    t->bin_edge[b] = (cycles_t) g.bin_ns[b] * t->cpu_mhz / 1000;
+    if( t->bin_edge[b] == 0 )
+      t->bin_edge[b] = 1;
+    t->bin_n[b] = 0;
+  }
+  for( o = 0; o < 64; ++o ) {
+    for( b = 0; b < g.n_bins && t->bin_edge[b] <= (1ull << o); ++b )
+      ;
+    t->bin_lut[o] = b;
+  }
+}
+
+
+/* The specialised loops below only take the (predicted not-taken) branch
+ * when a sample crosses the threshold, so the common path touches nothing
+ * but registers.  The stop flag is polled every [poll_n] trips round the
+ * loop, each of which takes [unroll] samples.  In LOOP_FLOOR mode every
+ * sample is kept in [floor] until [floor_n] have been taken.
+ */
+enum loop_mode { LOOP_UNSTORED, LOOP_STORED, LOOP_FLOOR };
+
+static inline __attribute__((always_inline))
+void doit_loop(struct thread* t, cycles_t threshold_cycles,
+               enum loop_mode mode, int clock, unsigned poll_n,
+               unsigned unroll, cycles_t* floor, unsigned floor_n, int bins)
+{
+  struct ring* r = t->ring;
+  struct interruption* i = t->interruptions;
+  struct interruption* i_end = t->interruptions + g.max_interruptions;
+  uint64_t* counts = t->hist->counts;
+  stamp_t prev_ts, now;
+  cycles_t diff, int_total = 0, int_min = (cycles_t) -1, int_max = 0;
+  unsigned int_n = 0, dropped = 0, migrations = 0, n, u, aux;
+  cycles_t bin_min = t->bin_edge[0];
+
+  clk_read(clock, &prev_ts, &aux);
+  while( ! t->stop ) {
+    for( n = 0; n < poll_n; ++n )
+      for( u = 0; u < unroll; ++u ) {
+        clk_read(clock, &now, &aux);
+        diff = now - prev_ts;
+        prev_ts = now;
+        if( bins && diff >= bin_min )
+          bin_count(t, diff);
+        if( __builtin_expect(diff >= threshold_cycles, 0) ) {
+          if( mode == LOOP_FLOOR ) {
+            floor[int_n++] = diff;
+            if( int_n == floor_n )
+              return;
+            continue;
+          }
+          int_total += diff;
+          ++int_n;
+          sj_hist_inc(counts, diff);
+          if( diff < int_min )
+            int_min = diff;
+          if( diff > int_max )
+            int_max = diff;
+          if( t->trigger_cycles )
+            trigger_note(t, now, diff);
+          /* Linux puts the cpu number in the bottom 12 bits. */
+          if( clock == SJ_CLOCK_RDTSCP && (aux & 0xfff) != (unsigned) t->core_i )
+            ++migrations;
+          if( mode == LOOP_STORED ) {
+            i->ts = now;
+            i->diff = diff;
+            if( ++i == i_end )
+              goto done;
+          }
+          else if( r != NULL && ! ring_push(r, now, diff) ) {
+            ++dropped;
+          }
+        }
+      }
+  }
+
+ done:
+  if( mode == LOOP_STORED )
+    t->c_interruption = i;
+  t->int_total = int_total;
+  t->int_n = int_n;
+  t->int_min = int_n ? int_min : 0;
+  t->int_max = int_max;
+  t->ring_dropped = dropped;
+  t->clock_migrations = migrations;
+}
+
+
+#define LOOP_FLOOR_N  4096
+
+#define DEFINE_LOOP(name, poll_n, unroll)                               \
+  static void doit_##name(struct thread* t, cycles_t th)                \
+  { doit_loop(t, th, LOOP_STORED, CLOCK_NATIVE, poll_n, unroll,         \
+              NULL, 0, 0); }                                            \
+  static void doit_unstored_##name(struct thread* t, cycles_t th)       \
+  { doit_loop(t, th, LOOP_UNSTORED, CLOCK_NATIVE, poll_n, unroll,       \
+              NULL, 0, 0); }                                            \
+  static void doit_floor_##name(struct thread* t, cycles_t* floor)      \
+  { doit_loop(t, 0, LOOP_FLOOR, CLOCK_NATIVE, poll_n, unroll,           \
+              floor, LOOP_FLOOR_N, 0); }                                \
+  static void doit_bins_##name(struct thread* t, cycles_t th)           \
+  { doit_loop(t, th, LOOP_STORED, CLOCK_NATIVE, poll_n, unroll,         \
+              NULL, 0, 1); }                                            \
+  static void doit_unstored_bins_##name(struct thread* t, cycles_t th)  \
+  { doit_loop(t, th, LOOP_UNSTORED, CLOCK_NATIVE, poll_n, unroll,       \
+              NULL, 0, 1); }
+
+DEFINE_LOOP(reg,         1, 1)
+DEFINE_LOOP(reg_n16,    16, 1)
+DEFINE_LOOP(reg_n16_u4, 16, 4)
+DEFINE_LOOP(reg_n64_u8, 64, 8)
+
+
+/* As doit(), but keeps every sample, to find the loop's own period. */
+static void doit_floor_classic(struct thread* t, cycles_t* floor)
+{
+  stamp_t prev_ts, now;
+  unsigned n = 0;
+
+  sj_frc(&prev_ts);
+  while( ! t->stop && n < LOOP_FLOOR_N ) {
+    sj_frc(&now);
+    floor[n++] = now - prev_ts;
+    prev_ts = now;
+  }
+}
+
+
+/* The classic loop doesn't do --bins, so has no bins loops. */
+static const struct loop_variant {
+  const char*          name;
+  void               (*stored)(struct thread*, cycles_t);
+  void               (*unstored)(struct thread*, cycles_t);
+  void               (*floor)(struct thread*, cycles_t*);
+  void               (*stored_bins)(struct thread*, cycles_t);
+  void               (*unstored_bins)(struct thread*, cycles_t);
+} loop_variants[] = {
+  { "classic",    doit, doit_unstored, doit_floor_classic, NULL, NULL },
+#define LOOP_VARIANT(name, fn)                                          \
+  { name, doit_##fn, doit_unstored_##fn, doit_floor_##fn,               \
+    doit_bins_##fn, doit_unstored_bins_##fn }
+  LOOP_VARIANT("reg",         reg),
+  LOOP_VARIANT("reg-n16",     reg_n16),
+  LOOP_VARIANT("reg-n16-u4",  reg_n16_u4),
+  LOOP_VARIANT("reg-n64-u8",  reg_n64_u8),
+#undef LOOP_VARIANT
+};
+
+#define N_LOOP_VARIANTS  (sizeof(loop_variants) / sizeof(loop_variants[0]))
+
+
+/* Other --clock sources get the register loop, which counts --bins when
+ * given, so serves as its own bins loop.
+ */
+#define DEFINE_CLOCK_LOOP(name, clock)                                  \
+  static void doit_##name(struct thread* t, cycles_t th)                \
+  { doit_loop(t, th, LOOP_STORED, clock, 1, 1, NULL, 0, g.n_bins != 0); } \
+  static void doit_unstored_##name(struct thread* t, cycles_t th)       \
+  { doit_loop(t, th, LOOP_UNSTORED, clock, 1, 1, NULL, 0,               \
+              g.n_bins != 0); }                                         \
+  static void doit_floor_##name(struct thread* t, cycles_t* floor)      \
+  { doit_loop(t, 0, LOOP_FLOOR, clock, 1, 1, floor, LOOP_FLOOR_N, 0); }
+
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_CLOCK_LOOP(rdtscp,        SJ_CLOCK_RDTSCP)
+DEFINE_CLOCK_LOOP(lfence_rdtsc,  SJ_CLOCK_LFENCE_RDTSC)
+#elif defined(__aarch64__)
+DEFINE_CLOCK_LOOP(isb_cntvct,    SJ_CLOCK_ISB_CNTVCT)
+#endif
+DEFINE_CLOCK_LOOP(clock_gettime, SJ_CLOCK_CLOCK_GETTIME)
+
+
+/* Indexed by clock; those without a name are not available here. */
+static const struct loop_variant clock_loops[SJ_N_CLOCKS] = {
+#define CLOCK_LOOP(clock, name, fn)                                     \
+  [clock] = { name, doit_##fn, doit_unstored_##fn, doit_floor_##fn,     \
+              doit_##fn, doit_unstored_##fn }
+#if defined(__x86_64__) || defined(__i386__)
+  CLOCK_LOOP(SJ_CLOCK_RDTSCP,        "rdtscp",        rdtscp),
+  CLOCK_LOOP(SJ_CLOCK_LFENCE_RDTSC,  "lfence-rdtsc",  lfence_rdtsc),
+#elif defined(__aarch64__)
+  CLOCK_LOOP(SJ_CLOCK_ISB_CNTVCT,    "isb-cntvct",    isb_cntvct),
+#endif
+  CLOCK_LOOP(SJ_CLOCK_CLOCK_GETTIME, "clock_gettime", clock_gettime),
+#undef CLOCK_LOOP
+};
+
+
+static int cycles_cmp(const void* a, const void* b)
+{
+  cycles_t ca = *(const cycles_t*) a;
+  cycles_t cb = *(const cycles_t*) b;
+  return (ca > cb) - (ca < cb);
+}
+
+
+/* --mode wakeup: instead of spinning, sleep until each period's deadline
+ * and take how late we woke as the interruption.  Lateness is converted to
+ * timestamp counter ticks, so the rest of the pipeline doesn't care.
+ */
+static void doit_wakeup(struct thread* t, cycles_t threshold_cycles, int store)
+{
+  struct ring* r = t->ring;
+  struct interruption* i = t->interruptions;
+  struct interruption* i_end = t->interruptions + g.max_interruptions;
+  uint64_t* counts = t->hist->counts;
+  uint64_t period = (uint64_t) g.wakeup_period_usec * 1000, next, now;
+  cycles_t diff, int_total = 0, int_min = (cycles_t) -1, int_max = 0;
+  unsigned int_n = 0, dropped = 0, wakeups = 0;
+  struct timespec ts;
+  stamp_t woke;
+  int rc;
+
+  next = mono_ns() + period;
+  while( ! t->stop ) {
+    ts.tv_sec = next / 1000000000;
+    ts.tv_nsec = next % 1000000000;
+    /* Returns the error rather than setting errno. */
+    while( (rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                 NULL)) == EINTR )
+      ;
+    if( rc != 0 ) {
+      fprintf(stderr, "%s: ERROR: clock_nanosleep failed on core %d (%s)\n",
+              APP_NAME, t->core_i, strerror(rc));
+      exit(2);
+    }
+    sj_frc(&woke);
+    now = mono_ns();
+    ++wakeups;
+    diff = (now - next) * t->cpu_mhz / 1000;
+    /* If we overran whole periods, don't try to catch up. */
+    while( next <= now )
+      next += period;
+    if( diff >= threshold_cycles ) {
+      int_total += diff;
+      ++int_n;
+      sj_hist_inc(counts, diff);
+      if( diff < int_min )
+        int_min = diff;
+      if( diff > int_max )
+        int_max = diff;
+      if( store ) {
+        i->ts = woke;
+        i->diff = diff;
+        if( ++i == i_end )
+          break;
+      }
+      else if( r != NULL && ! ring_push(r, woke, diff) ) {
+        ++dropped;
+      }
+    }
+  }
+
+  if( store )
+    t->c_interruption = i;
+  t->int_total = int_total;
+  t->int_n = int_n;
+  t->int_min = int_n ? int_min : 0;
+  t->int_max = int_max;
+  t->ring_dropped = dropped;
+  t->wakeups = wakeups;
+}
+
+
+/* --workload walk reads a line in each CACHE_LINE of the next WALK_CHUNK
+ * of the working set between timestamps, wrapping round at the end.
+ */
+#define WALK_CHUNK  4096
+
+static inline uint64_t walk_chunk(const uint64_t* p)
+{
+  uint64_t sum = 0;
+  unsigned k;
+  for( k = 0; k < WALK_CHUNK / sizeof(*p); k += CACHE_LINE / sizeof(*p) )
+    sum += p[k];
+  return sum;
+}
+
+
+/* Time taken to walk a chunk when nothing gets in the way: the median of
+ * a pass over the working set once it is warm.
+ */
+static void measure_walk_iter(struct thread* t)
+{
+  size_t c, n_chunks = g.walk_bytes / WALK_CHUNK;
+  size_t n = n_chunks < LOOP_FLOOR_N ? n_chunks : LOOP_FLOOR_N;
+  cycles_t iter[LOOP_FLOOR_N];
+  stamp_t prev, now;
+  uint64_t sum = 0;
+
+  for( c = 0; c < n_chunks; ++c )
+    sum += walk_chunk(t->walk + c * (WALK_CHUNK / sizeof(*t->walk)));
+  sj_frc(&prev);
+  for( c = 0; c < n; ++c ) {
+    sum += walk_chunk(t->walk + c * (WALK_CHUNK / sizeof(*t->walk)));
+    sj_frc(&now);
+    iter[c] = now - prev;
+    prev = now;
+  }
+  qsort(iter, n, sizeof(iter[0]), cycles_cmp);
+  t->walk_iter = iter[n / 2];
+  t->walk_sink = sum;
+}
+
+
+/* As the busy loop, but walking the working set between timestamps.  Only
+ * the time a chunk takes beyond walk_iter is lost, so that is what is
+ * compared with the threshold and recorded.  After an interruption, the
+ * time lost by the following pass over the working set is counted as the
+ * cost of recovering (refilling caches and TLB).  A new interruption ends
+ * the recovery.
+ */
+static void doit_walk(struct thread* t, cycles_t threshold_cycles, int store)
+{
+  struct ring* r = t->ring;
+  struct interruption* i = t->interruptions;
+  struct interruption* i_end = t->interruptions + g.max_interruptions;
+  uint64_t* counts = t->hist->counts;
+  size_t c = 0, n_chunks = g.walk_bytes / WALK_CHUNK, recov_left = 0;
+  cycles_t diff, int_total = 0, int_min = (cycles_t) -1, int_max = 0;
+  cycles_t base = t->walk_iter, recov = 0, recov_total = 0, recov_max = 0;
+  unsigned int_n = 0, dropped = 0, recov_n = 0;
+  stamp_t prev_ts, now;
+  uint64_t sum = 0;
+
+#define END_RECOVERY()                          \
+  do {                                          \
+    recov_total += recov;                       \
+    if( recov > recov_max )                     \
+      recov_max = recov;                        \
+    ++recov_n;                                  \
+  } while( 0 )
+
+  sj_frc(&prev_ts);
+  while( ! t->stop ) {
+    sum += walk_chunk(t->walk + c * (WALK_CHUNK / sizeof(*t->walk)));
+    if( ++c == n_chunks )
+      c = 0;
+    sj_frc(&now);
+    diff = now - prev_ts;
+    prev_ts = now;
+    diff = diff > base ? diff - base : 0;
+    if( diff >= threshold_cycles ) {
+      if( recov_left )
+        END_RECOVERY();
+      recov_left = n_chunks;
+      recov = 0;
+      int_total += diff;
+      ++int_n;
+      sj_hist_inc(counts, diff);
+      if( diff < int_min )
+        int_min = diff;
+      if( diff > int_max )
+        int_max = diff;
+      if( store ) {
+        i->ts = now;
+        i->diff = diff;
+        if( ++i == i_end )
+          break;
+      }
+      else if( r != NULL && ! ring_push(r, now, diff) ) {
+        ++dropped;
+      }
+    }
+    else if( recov_left ) {
+      recov += diff;
+      if( --recov_left == 0 )
+        END_RECOVERY();
+    }
+  }
+  if( recov_left )
+    END_RECOVERY();
+#undef END_RECOVERY
+
+  if( store )
+    t->c_interruption = i;
+  t->int_total = int_total;
+  t->int_n = int_n;
+  t->int_min = int_n ? int_min : 0;
+  t->int_max = int_max;
+  t->ring_dropped = dropped;
+  t->recov_total = recov_total;
+  t->recov_max = recov_max;
+  t->recov_n = recov_n;
+  t->recov_mean = recov_n ? recov_total / recov_n : 0;
+  t->walk_sink += sum;
+}
+
+
+/* Smallest gap between samples that the chosen loop can see. */
+static void measure_loop_floor(struct thread* t)
+{
+  cycles_t floor[LOOP_FLOOR_N];
+
+  /* Once to warm up, once for real. */
+  g.loop->floor(t, floor);
+  g.loop->floor(t, floor);
+  qsort(floor, LOOP_FLOOR_N, sizeof(floor[0]), cycles_cmp);
+  t->loop_min = floor[0];
+  t->loop_median = floor[LOOP_FLOOR_N / 2];
+}
+
+
+/* Stable LSD radix sort of [n] interruptions by length, a byte at a time.
+ * Passes over bytes that are the same in every key are skipped, which for
+ * typical data leaves 3 or 4 passes.  [tmp] must have room for [n]
+ * entries, and the result ends up in either [a] or [tmp] (returned).
+ */
+static struct interruption* radix_sort_interruptions(struct interruption* a,
+                                                     struct interruption* tmp,
+                                                     size_t n)
+{
+  struct interruption* src = a;
+  struct interruption* dst = tmp;
+  struct interruption* swap;
+  size_t count[256], pos, c;
+  unsigned shift, d;
+  size_t i;
+
+  for( shift = 0; shift < 64; shift += 8 ) {
+    memset(count, 0, sizeof(count));
+    for( i = 0; i < n; ++i )
+      ++count[(src[i].diff >> shift) & 0xff];
+    if( count[(src[0].diff >> shift) & 0xff] == n )
+      continue;
+    for( pos = 0, d = 0; d < 256; ++d ) {
+      c = count[d];
+      count[d] = pos;
+      pos += c;
+    }
+    for( i = 0; i < n; ++i )
+      dst[count[(src[i].diff >> shift) & 0xff]++] = src[i];
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  return src;
+}
+
+
+/* Leaves a copy of the interruptions sorted by length in [t->sorted]. */
+static void sort_interruptions(struct thread* t)
+{
+  size_t n = t->c_interruption - t->interruptions;
+  struct interruption* a;
+  struct interruption* tmp;
+
+  if( t->sorted != NULL || n == 0 )
+    return;
+  TEST(a = malloc(n * sizeof(a[0])));
+  TEST(tmp = malloc(n * sizeof(tmp[0])));
+  memcpy(a, t->interruptions, n * sizeof(a[0]));
+  if( radix_sort_interruptions(a, tmp, n) == a ) {
+    t->sorted = a;
+    free(tmp);
+  }
+  else {
+    t->sorted = tmp;
+    free(a);
+  }
+}
+
+
+#define sorted_pc(t, p)                                         \
+  cycles_to_ns((t), (t)->sorted[(size_t) ((t)->int_n * (p))].diff)
+
+
+static void thread_calc_stats(struct thread* t)
+{
+  struct sj_stats* s = &(t->stats);
+
+  /* int_n, int_min, int_max and int_total are gathered while measuring.
+   * If we kept all of the interruptions the percentiles are exact,
+   * otherwise (including if any were dropped) they come from the
+   * histogram.
+   */
+  t->runtime = t->frc_stop - t->frc_start;
+  if( t->int_n == 0 ) {
+    t->int_min = 0;
+    t->int_max = 0;
+  }
+  sj_stats_from_hist(s, t->cpu_mhz, t->hist, t->int_n, t->int_min,
+                     t->int_max, t->int_total, t->runtime);
+  if( t->int_n && g.keep_raw &&
+      t->c_interruption - t->interruptions == t->int_n ) {
+    sort_interruptions(t);
+    s->int_median = sorted_pc(t, 0.5);
+    s->int_90 = sorted_pc(t, 0.9);
+    s->int_99 = sorted_pc(t, 0.99);
+    s->int_999 = sorted_pc(t, 0.999);
+    s->int_9999 = sorted_pc(t, 0.9999);
+    s->int_99999 = sorted_pc(t, 0.99999);
+  }
+}
+
+
+static void post_test_checks(struct thread* threads)
+{
+  struct thread* t;
+  int early = 0;
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    if( t->c_interruption - t->interruptions == g.max_interruptions ) {
       early = 1;
       fprintf(stderr, "%s: ERROR: Thread %d finished at %.1fs (max=%d)\n",
               APP_NAME, i, cycles_to_sec_f(t, t->frc_stop - t->frc_start),
@@ -404,285 +1885,2765 @@ static void post_test_checks(struct thread* threads)
     }
   }
 
-  if( early ) {
-    fprintf(stderr, "%s: You probably need to increase the interruption "
-            "threshold.\n", APP_NAME);
-    exit(2);
+  if( early ) {
+    fprintf(stderr, "%s: You probably need to increase the interruption "
+            "threshold.\n", APP_NAME);
+    exit(2);
+  }
+}
+
+
+static void write_thread_raw_totals(const struct thread* t, FILE* f,
+                                    int n_interruptions)
+{
+  cycles_t delta;
+
+  fprintf(f, "# n_interruptions: %d\n", n_interruptions);
+  if( n_interruptions == 0 )
+    return;
+  delta = t->frc_stop - t->frc_start;
+  fprintf(f, "# interruption: %f%%\n", 100.0 * t->int_total / delta);
+  fprintf(f, "# total_interruption: %"PRId64" cycles\n", t->int_total);
+  fprintf(f, "# total_runtime: %"PRIu64" cycles\n", delta);
+  fprintf(f, "# total_interruption: %.9f seconds\n",
+          cycles_to_sec_f(t, t->int_total));
+  fprintf(f, "# total_runtime: %.9f seconds\n", cycles_to_sec_f(t, delta));
+}
+
+
+static void write_thread_raw(struct thread* t, FILE* f)
+{
+  int j, n_interruptions = (int) (t->c_interruption - t->interruptions);
+  const struct interruption* i;
+  const struct interruption* prev;
+  cycles_t delta;
+  char cause[64];
+
+  fprintf(f, "# cpu_mhz: %u\n", t->cpu_mhz);
+  fprintf(f, "# clock: %s\n", clock_names[g.clock]);
+  fprintf(f, "# threshold: %uns\n", g.threshold_nsec);
+  write_thread_raw_totals(t, f, n_interruptions);
+  if( n_interruptions == 0 )
+    return;
+  fprintf(f, "#\n");
+
+  if( ! g.sort_raw ) {
+    fprintf(f, "#      Timestamp      delta   <== interruption =>%s\n",
+            t->causes ? "   cause" : "");
+    fprintf(f, "#         (nsec)     (usec)   (cycles)     (nsec)\n");
+    /*         "1234567890123456 1234567890 1234567890 1234567890" */
+
+    i = prev = t->interruptions;
+    for( ; i < t->c_interruption; prev = i, ++i ) {
+      delta = i->ts - prev->ts;
+      fprintf(f, "%16"PRIu64" %10"PRIu64" %10"PRId64" %10"PRIu64,
+              cycles_to_ns(t, i->ts - t->frc_start),
+              cycles_to_us(t, delta), i->diff, cycles_to_ns(t, i->diff));
+      if( t->causes )
+        fprintf(f, " %s", sj_format_causes(cause, sizeof(cause),
+                                           t->causes[i - t->interruptions]));
+      fprintf(f, "\n");
+    }
+  }
+  else {
+    fprintf(f, "#      Timestamp   <== interruption =>%s\n",
+            t->causes ? "   cause" : "");
+    fprintf(f, "#         (nsec)   (cycles)     (nsec)\n");
+    /*         "1234567890123456 1234567890 1234567890" */
+
+    sort_interruptions(t);
+    for( j = 0; j < n_interruptions; ++j ) {
+      i = &(t->sorted[j]);
+      fprintf(f, "%16"PRIu64" %10"PRId64" %10"PRIu64,
+              cycles_to_ns(t, i->ts - t->frc_start),
+              i->diff, cycles_to_ns(t, i->diff));
+      if( t->causes )
+        fprintf(f, " %s", sj_format_causes(cause, sizeof(cause),
+                                           cause_of(t, i->ts)));
+      fprintf(f, "\n");
+    }
+  }
+}
+
+
+static void raw_bin_header(struct sj_raw_header* h, const struct thread* t,
+                           uint64_t n_records, unsigned flags)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, SJ_RAW_MAGIC, sizeof(SJ_RAW_MAGIC));
+  h->version = SJ_RAW_VERSION;
+  h->header_size = sizeof(*h);
+  h->cpu_mhz = t->cpu_mhz;
+  h->threshold_nsec = g.threshold_nsec;
+  h->core_i = t->core_i;
+  h->flags = flags;
+  h->frc_start = t->frc_start;
+  h->frc_stop = t->frc_stop;
+  h->int_total = t->int_total;
+  h->clock = g.clock;
+  h->n_records = n_records;
+  if( flags & SJ_RAW_F_STREAM )
+    h->n_dropped = t->ring_dropped;
+}
+
+
+static void write_thread_raw_bin(struct thread* t, FILE* f)
+{
+  int n_interruptions = (int) (t->c_interruption - t->interruptions);
+  struct sj_raw_header h;
+
+  uint32_t cause;
+  int j;
+
+  raw_bin_header(&h, t, n_interruptions,
+                 (g.sort_raw ? SJ_RAW_F_SORTED : 0) |
+                 (t->causes ? SJ_RAW_F_CAUSES : 0));
+  fwrite(&h, sizeof(h), 1, f);
+  if( ! g.sort_raw ) {
+    fwrite(t->interruptions, sizeof(t->interruptions[0]), n_interruptions, f);
+    if( t->causes )
+      fwrite(t->causes, sizeof(t->causes[0]), n_interruptions, f);
+  }
+  else if( n_interruptions ) {
+    sort_interruptions(t);
+    fwrite(t->sorted, sizeof(t->sorted[0]), n_interruptions, f);
+    if( t->causes )
+      for( j = 0; j < n_interruptions; ++j ) {
+        cause = cause_of(t, t->sorted[j].ts);
+        fwrite(&cause, sizeof(cause), 1, f);
+      }
+  }
+}
+
+
+static int raw_core_digits(const struct thread* threads)
+{
+  char buf[16];
+  int i, core_digits, max_core_i = -1;
+
+  /* Find out max core_i so we can pad the core_i in the filename to the
+   * appropriate width.
+   */
+  for( i = 0; i < g.n_threads; ++i )
+    if( threads[i].core_i > max_core_i )
+      max_core_i = threads[i].core_i;
+  sprintf(buf, "%d%n", max_core_i, &core_digits);
+  return core_digits;
+}
+
+
+static FILE* open_raw(const char* outf, int core_digits, int core_i)
+{
+  char fname[strlen(outf) + 10];
+  FILE* f;
+
+  sprintf(fname, "%s.%0*d", outf, core_digits, core_i);
+  if( (f = fopen(fname, "w")) == NULL )
+    fprintf(stderr, "%s: ERROR: Could not open '%s' for writing (%s)\n",
+            APP_NAME, fname, strerror(errno));
+  return f;
+}
+
+
+static int write_thread_raw_file(struct thread* t, const char* outf,
+                                 int core_digits)
+{
+  FILE* f;
+
+  if( (f = open_raw(outf, core_digits, t->core_i)) == NULL )
+    return 3;
+  if( g.raw_bin )
+    write_thread_raw_bin(t, f);
+  else
+    write_thread_raw(t, f);
+  if( fclose(f) != 0 ) {
+    fprintf(stderr, "%s: ERROR: Failed writing raw output for core %d (%s)\n",
+            APP_NAME, t->core_i, strerror(errno));
+    return 3;
+  }
+  return 0;
+}
+
+
+static int write_raw(struct thread* threads, const char* outf)
+{
+  int i, core_digits = raw_core_digits(threads);
+  int rc = 0;
+
+  for( i = 0; i < g.n_threads; ++i )
+    if( write_thread_raw_file(&(threads[i]), outf, core_digits) != 0 )
+      rc = 3;
+  return rc;
+}
+
+
+/* Move whatever the measuring thread has pushed into its ring out to the
+ * raw file (if any).  Only called by the collector thread.
+ */
+static void stream_drain(struct thread* t)
+{
+  struct ring* r = t->ring;
+  uint64_t tail = r->tail;
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  const struct interruption* i;
+
+  if( head == tail )
+    return;
+  if( g.gather ) {
+    /* Keep the records for the usual post-processing.  We're on the
+     * housekeeping core, so growing the buffer doesn't disturb anyone.
+     */
+    size_t n = t->c_interruption - t->interruptions;
+    if( n + (head - tail) > t->gather_cap ) {
+      t->gather_cap = (t->gather_cap ? t->gather_cap : 4096) * 2;
+      while( t->gather_cap < n + (head - tail) )
+        t->gather_cap *= 2;
+      TEST(t->interruptions = realloc(t->interruptions, t->gather_cap *
+                                      sizeof(t->interruptions[0])));
+      t->c_interruption = t->interruptions + n;
+    }
+    for( ; tail != head; ++tail )
+      *(t->c_interruption++) = r->rec[tail & r->mask];
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return;
+  }
+  if( g.raw_bin ) {
+    /* Records go out as they are, in at most two pieces as the ring may
+     * wrap.
+     */
+    uint64_t n = head - tail, n1 = r->mask + 1 - (tail & r->mask);
+    if( n1 > n )
+      n1 = n;
+    if( t->stream_f != NULL ) {
+      fwrite(&(r->rec[tail & r->mask]), sizeof(r->rec[0]), n1, t->stream_f);
+      fwrite(&(r->rec[0]), sizeof(r->rec[0]), n - n1, t->stream_f);
+    }
+    t->stream_n += n;
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    return;
+  }
+  if( t->stream_f != NULL && t->stream_n == 0 ) {
+    /* First record for this thread: cpu_mhz and frc_start are stable
+     * now as they were written before the record was published.
+     */
+    fprintf(t->stream_f, "# cpu_mhz: %u\n", t->cpu_mhz);
+    fprintf(t->stream_f, "# clock: %s\n", clock_names[g.clock]);
+    fprintf(t->stream_f, "# threshold: %uns\n", g.threshold_nsec);
+    fprintf(t->stream_f, "#\n");
+    fprintf(t->stream_f, "#      Timestamp      delta   <== interruption =>\n");
+    fprintf(t->stream_f, "#         (nsec)     (usec)   (cycles)     (nsec)\n");
+    t->stream_prev_ts = r->rec[tail & r->mask].ts;
+  }
+  for( ; tail != head; ++tail ) {
+    i = &(r->rec[tail & r->mask]);
+    if( t->stream_f != NULL )
+      fprintf(t->stream_f, "%16"PRIu64" %10"PRIu64" %10"PRId64" %10"PRIu64"\n",
+              cycles_to_ns(t, i->ts - t->frc_start),
+              cycles_to_us(t, i->ts - t->stream_prev_ts),
+              i->diff, cycles_to_ns(t, i->diff));
+    t->stream_prev_ts = i->ts;
+    ++(t->stream_n);
+  }
+  __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+
+static void* collector_main(void* arg)
+{
+  struct thread* threads = arg;
+  int i, run;
+
+  TEST(move_to_core(g.housekeeping_core) == 0);
+  do {
+    /* Read the flag before draining so that we always do one last pass
+     * after the measuring threads have finished.
+     */
+    run = g.collector_run;
+    for( i = 0; i < g.n_threads; ++i )
+      stream_drain(&(threads[i]));
+    if( run )
+      usleep(10000);
+  } while( run );
+  return NULL;
+}
+
+
+static int stream_open(struct thread* threads)
+{
+  struct sj_raw_header h;
+  int i, core_digits, rc = 0;
+
+  if( g.raw_prefix == NULL )
+    return 0;
+  core_digits = raw_core_digits(threads);
+  for( i = 0; i < g.n_threads; ++i ) {
+    if( (threads[i].stream_f = open_raw(g.raw_prefix, core_digits,
+                                        threads[i].core_i)) == NULL ) {
+      rc = 3;
+    }
+    else if( g.raw_bin ) {
+      /* Leave room for the header, which is filled in by stream_close(). */
+      memset(&h, 0, sizeof(h));
+      fwrite(&h, sizeof(h), 1, threads[i].stream_f);
+    }
+  }
+  return rc;
+}
+
+
+static void stream_close(struct thread* threads)
+{
+  struct sj_raw_header h;
+  struct thread* t;
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    if( t->stream_f == NULL )
+      continue;
+    if( g.raw_bin ) {
+      raw_bin_header(&h, t, t->stream_n, SJ_RAW_F_STREAM);
+      if( fseek(t->stream_f, 0, SEEK_SET) == 0 )
+        fwrite(&h, sizeof(h), 1, t->stream_f);
+      fclose(t->stream_f);
+      t->stream_f = NULL;
+      continue;
+    }
+    if( t->stream_n == 0 ) {
+      fprintf(t->stream_f, "# cpu_mhz: %u\n", t->cpu_mhz);
+      fprintf(t->stream_f, "# clock: %s\n", clock_names[g.clock]);
+      fprintf(t->stream_f, "# threshold: %uns\n", g.threshold_nsec);
+    }
+    fprintf(t->stream_f, "#\n");
+    write_thread_raw_totals(t, t->stream_f, t->int_n);
+    fprintf(t->stream_f, "# dropped: %u\n", t->ring_dropped);
+    fclose(t->stream_f);
+    t->stream_f = NULL;
+  }
+}
+
+
+static uint64_t* counters_add(struct counters* c, const char* name)
+{
+  if( c->n == c->cap ) {
+    c->cap = c->cap ? c->cap * 2 : 64;
+    TEST(c->names = realloc(c->names, c->cap * sizeof(c->names[0])));
+    TEST(c->vals = realloc(c->vals, c->cap * g.n_threads * sizeof(c->vals[0])));
+  }
+  snprintf(c->names[c->n], sizeof(c->names[0]), "%s", name);
+  memset(&(c->vals[c->n * g.n_threads]), 0, g.n_threads * sizeof(c->vals[0]));
+  return &(c->vals[(c->n++) * g.n_threads]);
+}
+
+
+/* Reads a table in the format of /proc/interrupts and /proc/softirqs: a
+ * header line naming the CPU of each column, then a line per counter.
+ */
+static void read_proc_table(struct counters* c, const char* path,
+                            const char* prefix, const struct thread* threads)
+{
+  char name[40], *line = NULL, *p, *end, *desc;
+  int n_cols = 0, col, i, cpu_of_col[CPU_SETSIZE];
+  uint64_t v, *vals;
+  size_t line_len = 0;
+  FILE* f;
+
+  /* Lines are long on big machines, hence getline(). */
+  if( (f = fopen(path, "r")) == NULL )
+    return;
+  if( getline(&line, &line_len, f) < 0 ) {
+    free(line);
+    fclose(f);
+    return;
+  }
+  for( p = line; (p = strstr(p, "CPU")) != NULL && n_cols < CPU_SETSIZE; )
+    cpu_of_col[n_cols++] = strtol(p + 3, &p, 10);
+
+  while( getline(&line, &line_len, f) >= 0 ) {
+    if( (p = strchr(line, ':')) == NULL )
+      continue;
+    *p++ = '\0';
+    vals = NULL;
+    for( col = 0; col < n_cols; ++col ) {
+      v = strtoull(p, &end, 10);
+      if( end == p )
+        break;
+      p = end;
+      if( vals == NULL ) {
+        /* Name numbered IRQs after the device, which is the last word. */
+        desc = line + strspn(line, " ");
+        if( desc[0] >= '0' && desc[0] <= '9' ) {
+          end = p + strlen(p);
+          while( end > p && (end[-1] == '\n' || end[-1] == ' ') )
+            *--end = '\0';
+          while( end > p && end[-1] != ' ' )
+            --end;
+          snprintf(name, sizeof(name), "%s%s/%s", prefix, desc, end);
+        }
+        else {
+          snprintf(name, sizeof(name), "%s%s", prefix, desc);
+        }
+        vals = counters_add(c, name);
+      }
+      for( i = 0; i < g.n_threads; ++i )
+        if( threads[i].core_i == cpu_of_col[col] )
+          vals[i] = v;
+    }
+    /* Lines such as ERR and MIS are not per-cpu. */
+    if( vals != NULL && col < n_cols )
+      --(c->n);
+  }
+  free(line);
+  fclose(f);
+}
+
+
+static void read_schedstat(struct counters* c, const struct thread* threads)
+{
+  unsigned long long f[9];
+  uint64_t* sched;
+  uint64_t* wakeups;
+  char line[512];
+  int cpu, i;
+  FILE* fp;
+
+  if( (fp = fopen("/proc/schedstat", "r")) == NULL )
+    return;
+  sched = counters_add(c, "sched:schedule");
+  wakeups = counters_add(c, "sched:wakeups");
+  while( fgets(line, sizeof(line), fp) )
+    if( sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &cpu, &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7],
+               &f[8]) == 10 )
+      for( i = 0; i < g.n_threads; ++i )
+        if( threads[i].core_i == cpu ) {
+          sched[i] = f[2];
+          wakeups[i] = f[4];
+        }
+  fclose(fp);
+}
+
+
+/* Steal time of each measured core, in ns, from /proc/stat. */
+static void read_steal(const struct thread* threads, uint64_t* steal)
+{
+  unsigned long long f[8];
+  long hz = sysconf(_SC_CLK_TCK);
+  char line[512];
+  int cpu, i;
+  FILE* fp;
+
+  for( i = 0; i < g.n_threads; ++i )
+    steal[i] = 0;
+  if( (fp = fopen("/proc/stat", "r")) == NULL )
+    return;
+  /* Not the "cpu " line, which is the total over all cpus. */
+  while( fgets(line, sizeof(line), fp) )
+    if( strncmp(line, "cpu", 3) == 0 && isdigit((unsigned char) line[3]) &&
+        sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+               &cpu, &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6],
+               &f[7]) == 9 )
+      for( i = 0; i < g.n_threads; ++i )
+        if( threads[i].core_i == cpu )
+          steal[i] = f[7] * (1000000000 / hz);
+  fclose(fp);
+}
+
+
+/* Called on the housekeeping core just before GO and again once the
+ * measuring threads have finished, so the parsing doesn't disturb them.
+ */
+static void attribute_snapshot(struct counters* c,
+                               const struct thread* threads)
+{
+  c->n = 0;
+  read_proc_table(c, "/proc/interrupts", "irq:", threads);
+  read_proc_table(c, "/proc/softirqs", "softirq:", threads);
+  read_schedstat(c, threads);
+}
+
+
+struct offset_probe {
+  int                  core_i;
+  unsigned             seq;
+  stamp_t              reply;
+};
+
+
+static void* offset_helper(void* arg)
+{
+  struct offset_probe* p = arg;
+  unsigned k;
+  stamp_t now;
+
+  TEST(move_to_core(p->core_i) == 0);
+  for( k = 1; k <= OFFSET_ROUNDS; ++k ) {
+    while( __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE) != 2 * k - 1 )
+      relax();
+    frc(&now);
+    p->reply = now;
+    __atomic_store_n(&p->seq, 2 * k, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+
+/* Find the offset of each core's frc() relative to ours by bouncing a
+ * cache line off a helper thread on that core.  The round trip with the
+ * shortest time gives the tightest bound.
+ */
+static void measure_frc_offsets(struct thread* threads)
+{
+  struct offset_probe p;
+  pthread_t helper;
+  stamp_t t0, t2;
+  cycles_t best;
+  unsigned k;
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    struct thread* t = &(threads[i]);
+    t->frc_offset = 0;
+    t->frc_offset_err = 0;
+    if( t->core_i == g.housekeeping_core )
+      continue;
+    p.core_i = t->core_i;
+    p.seq = 0;
+    start_thread(&helper, offset_helper, &p);
+    best = (cycles_t) -1;
+    for( k = 1; k <= OFFSET_ROUNDS; ++k ) {
+      frc(&t0);
+      __atomic_store_n(&p.seq, 2 * k - 1, __ATOMIC_RELEASE);
+      while( __atomic_load_n(&p.seq, __ATOMIC_ACQUIRE) != 2 * k )
+        relax();
+      frc(&t2);
+      if( t2 - t0 < best ) {
+        best = t2 - t0;
+        t->frc_offset = (int64_t) (p.reply - (t0 + best / 2));
+      }
+    }
+    pthread_join(helper, NULL);
+    t->frc_offset_err = best / 2;
+  }
+}
+
+
+/* The next interruption of a core, in find_coincidences()'s merge. */
+struct merge_head {
+  stamp_t              start;
+  unsigned             core;
+};
+
+
+static stamp_t merge_start(const struct thread* t, size_t pos)
+{
+  const struct interruption* in = &(t->interruptions[pos]);
+  return in->ts - in->diff - t->frc_offset;
+}
+
+
+/* Restores the min-heap order of [hp] below [i]. */
+static void merge_heap_down(struct merge_head* hp, unsigned n, unsigned i)
+{
+  struct merge_head x = hp[i];
+  unsigned c;
+
+  while( (c = 2 * i + 1) < n ) {
+    if( c + 1 < n && hp[c + 1].start < hp[c].start )
+      ++c;
+    if( ! (hp[c].start < x.start) )
+      break;
+    hp[i] = hp[c];
+    i = c;
+  }
+  hp[i] = x;
+}
+
+
+/* Merge the interruptions of all cores in order of when they started (on
+ * the housekeeping core's clock), and find the clusters in which at least
+ * g.coincide_k cores were interrupted within the window.
+ */
+static void find_coincidences(struct thread* threads)
+{
+  cycles_t window = (cycles_t) g.coincide_window_nsec * threads[0].cpu_mhz
+    / 1000;
+  size_t n = 0, cap = 0, i, j, k, pos[g.n_threads];
+  unsigned in_window[g.n_threads], n_cores, n_heap = 0, c, h;
+  struct merged { stamp_t start, end; unsigned core; } *m = NULL;
+  struct merge_head heap[g.n_threads];
+  const struct thread* t;
+  struct cluster* cl;
+
+  for( c = 0; c < g.n_threads; ++c ) {
+    t = &(threads[c]);
+    pos[c] = 0;
+    in_window[c] = 0;
+    threads[c].int_coincident = 0;
+    n += t->c_interruption - t->interruptions;
+    if( t->c_interruption > t->interruptions ) {
+      heap[n_heap].start = merge_start(t, 0);
+      heap[n_heap++].core = c;
+    }
+  }
+  TEST(m = malloc((n ? n : 1) * sizeof(m[0])));
+
+  /* Each core's interruptions are already in time order, so a heap of
+   * each core's next one gives them all in order.
+   */
+  for( c = n_heap / 2; c-- > 0; )
+    merge_heap_down(heap, n_heap, c);
+  for( i = 0; i < n; ++i ) {
+    h = heap[0].core;
+    t = &(threads[h]);
+    m[i].start = heap[0].start;
+    m[i].end = t->interruptions[pos[h]].ts - t->frc_offset;
+    m[i].core = h;
+    if( &(t->interruptions[++pos[h]]) < t->c_interruption )
+      heap[0].start = merge_start(t, pos[h]);
+    else
+      heap[0] = heap[--n_heap];
+    merge_heap_down(heap, n_heap, 0);
+  }
+
+  g.n_clusters = 0;
+  for( i = 0, j = 0, n_cores = 0; i < n; ) {
+    while( j < n && m[j].start - m[i].start <= window )
+      if( in_window[m[j++].core]++ == 0 )
+        ++n_cores;
+    if( n_cores < g.coincide_k ) {
+      if( --in_window[m[i++].core] == 0 )
+        --n_cores;
+      continue;
+    }
+    if( g.n_clusters == cap ) {
+      cap = cap ? cap * 2 : 64;
+      TEST(g.clusters = realloc(g.clusters, cap * sizeof(g.clusters[0])));
+    }
+    cl = &(g.clusters[g.n_clusters++]);
+    cl->start = m[i].start;
+    cl->span = 0;
+    cl->max = 0;
+    cl->n_cores = n_cores;
+    for( k = i; k < j; ++k ) {
+      if( m[k].end - cl->start > cl->span )
+        cl->span = m[k].end - cl->start;
+      if( m[k].end - m[k].start > cl->max )
+        cl->max = m[k].end - m[k].start;
+      ++(threads[m[k].core].int_coincident);
+      in_window[m[k].core] = 0;
+    }
+    n_cores = 0;
+    i = j;
+  }
+  free(m);
+}
+
+
+static int cluster_cmp_max(const void* a, const void* b)
+{
+  const struct cluster* ca = a;
+  const struct cluster* cb = b;
+  return (ca->max < cb->max) - (ca->max > cb->max);
+}
+
+
+/* List the worst clusters found by find_coincidences(). */
+static void write_coincidences(struct thread* threads, FILE* f)
+{
+  struct thread* t = &(threads[0]);
+  const struct cluster* cl;
+  unsigned i;
+
+  fprintf(f, "# coincidence: %u clusters of >= %u cores within %uns\n",
+          g.n_clusters, g.coincide_k, g.coincide_window_nsec);
+  if( g.n_clusters == 0 )
+    return;
+  qsort(g.clusters, g.n_clusters, sizeof(g.clusters[0]), cluster_cmp_max);
+  fprintf(f, "#      Timestamp  cores       span        max\n");
+  fprintf(f, "#         (nsec)            (nsec)     (nsec)\n");
+  /*         "1234567890123456 123456 1234567890 1234567890" */
+  for( i = 0; i < g.n_clusters && i < COINCIDE_MAX_LISTED; ++i ) {
+    cl = &(g.clusters[i]);
+    fprintf(f, "#%15"PRIu64" %6u %10"PRIu64" %10"PRIu64"\n",
+            cycles_to_ns(t, cl->start - t->frc_start + t->frc_offset),
+            cl->n_cores, cycles_to_ns(t, cl->span), cycles_to_ns(t, cl->max));
+  }
+}
+
+/* In-place radix-2 FFT.  [n] must be a power of 2. */
+static void fft(double complex* x, size_t n, int inverse)
+{
+  double complex u, v, w, wl;
+  size_t i, j, k, bit, len;
+  double a;
+
+  for( i = 1, j = 0; i < n; ++i ) {
+    for( bit = n >> 1; j & bit; bit >>= 1 )
+      j ^= bit;
+    j ^= bit;
+    if( i < j ) {
+      u = x[i];
+      x[i] = x[j];
+      x[j] = u;
+    }
+  }
+  for( len = 2; len <= n; len <<= 1 ) {
+    a = (inverse ? 2 : -2) * M_PI / len;
+    wl = cos(a) + I * sin(a);
+    for( i = 0; i < n; i += len )
+      for( w = 1, k = 0; k < len / 2; ++k, w *= wl ) {
+        u = x[i + k];
+        v = x[i + k + len / 2] * w;
+        x[i + k] = u + v;
+        x[i + k + len / 2] = u - v;
+      }
+  }
+}
+
+
+#define int_start(in)  ((in)->ts - (in)->diff)
+
+
+/* Finds the interruptions from [used] on that start about [period] after
+ * another, marking both in [match] and collecting the gaps in [gaps].
+ * Returns the number of gaps.
+ */
+static size_t period_match(const struct thread* t, const char* used,
+                           char* match, cycles_t period, cycles_t tol,
+                           cycles_t* gaps)
+{
+  const struct interruption* in = t->interruptions;
+  size_t n = t->c_interruption - in, n_gaps = 0, i, j, lo, hi;
+  stamp_t want;
+
+  for( i = 0; i < n; ++i ) {
+    if( used[i] )
+      continue;
+    want = int_start(&(in[i])) + period - tol;
+    for( lo = i + 1, hi = n; lo < hi; ) {
+      j = (lo + hi) / 2;
+      if( int_start(&(in[j])) < want )
+        lo = j + 1;
+      else
+        hi = j;
+    }
+    for( j = lo; j < n && int_start(&(in[j])) <= want + 2 * tol; ++j )
+      if( ! used[j] ) {
+        match[i] = match[j] = 1;
+        gaps[n_gaps++] = int_start(&(in[j])) - int_start(&(in[i]));
+        break;
+      }
+  }
+  return n_gaps;
+}
+
+
+/* Looks for the periods that most of this core's interruptions recur at.
+ * The autocorrelation of the binned start times (by FFT) suggests a
+ * period, which is then measured from the interruptions that recur at
+ * about that interval.  Those are taken out and the next period looked
+ * for.
+ */
+static void find_periods(struct thread* t)
+{
+  const struct interruption* in = t->interruptions;
+  size_t n_ints = t->c_interruption - in, n_bins, n, i, l, lmax, best_l;
+  cycles_t bin, period, tol, *gaps;
+  double complex* x;
+  double best, *s;
+  char *used, *match;
+  uint64_t matched_total;
+
+  t->n_periods = 0;
+  if( n_ints < PERIOD_MIN_EVENTS || t->int_total == 0 )
+    return;
+  bin = (cycles_t) PERIOD_MIN_BIN_NS * t->cpu_mhz / 1000;
+  if( bin < 2 * t->runtime / PERIOD_FFT_N + 1 )
+    bin = 2 * t->runtime / PERIOD_FFT_N + 1;
+  n_bins = t->runtime / bin + 1;
+  for( n = 2; n < 2 * n_bins; n <<= 1 )
+    ;
+  lmax = (PERIOD_MAX_NS * t->cpu_mhz / 1000) / bin;
+  if( lmax > n_bins / 4 )
+    lmax = n_bins / 4;
+  if( lmax < 4 )
+    return;
+  TEST(x = malloc(n * sizeof(x[0])));
+  TEST(s = malloc((lmax + 2) * sizeof(s[0])));
+  TEST(gaps = malloc(n_ints * sizeof(gaps[0])));
+  TEST(used = calloc(n_ints, 1));
+  TEST(match = malloc(n_ints));
+
+  while( t->n_periods < PERIOD_MAX ) {
+    for( i = 0; i < n; ++i )
+      x[i] = 0;
+    for( i = 0; i < n_ints; ++i )
+      if( ! used[i] && int_start(&(in[i])) >= t->frc_start &&
+          (int_start(&(in[i])) - t->frc_start) / bin < n_bins )
+        x[(int_start(&(in[i])) - t->frc_start) / bin] += 1;
+    fft(x, n, 0);
+    for( i = 0; i < n; ++i )
+      x[i] = creal(x[i]) * creal(x[i]) + cimag(x[i]) * cimag(x[i]);
+    fft(x, n, 1);
+
+    /* Smooth over neighbouring bins, as a period rarely fits one bin.
+     * Multiples of a period correlate about as well as the period, so
+     * take the first lag that nearly matches the best.
+     */
+    for( l = 2; l <= lmax + 1; ++l )
+      s[l] = creal(x[l - 1]) + creal(x[l]) + creal(x[l + 1]);
+    for( best = 0, best_l = 0, l = 3; l <= lmax; ++l )
+      if( s[l] > best ) {
+        best = s[l];
+        best_l = l;
+      }
+    if( best_l == 0 )
+      break;
+    for( l = 3; l < best_l; ++l )
+      if( s[l] >= 0.7 * best && s[l] >= s[l - 1] && s[l] >= s[l + 1] )
+        break;
+
+    period = l * bin;
+    tol = 2 * bin;
+    memset(match, 0, n_ints);
+    i = period_match(t, used, match, period, tol, gaps);
+    if( i < PERIOD_MIN_EVENTS )
+      break;
+    qsort(gaps, i, sizeof(gaps[0]), cycles_cmp);
+    period = gaps[i / 2];
+    for( matched_total = 0, i = 0; i < n_ints; ++i )
+      if( match[i] ) {
+        matched_total += in[i].diff;
+        used[i] = 1;
+      }
+    if( matched_total < PERIOD_MIN_SHARE * t->int_total )
+      break;
+    t->periods[t->n_periods].period_ns = cycles_to_ns(t, period);
+    t->periods[t->n_periods].share = (double) matched_total / t->int_total;
+    ++(t->n_periods);
+  }
+
+  free(match);
+  free(used);
+  free(gaps);
+  free(s);
+  free(x);
+}
+
+
+/* Well known periods, for a hint as to what is behind one. */
+static const struct {
+  uint64_t             period_ns;
+  const char*          what;
+} known_periods[] = {
+  { 1000000,    "CONFIG_HZ=1000 tick" },
+  { 3333333,    "CONFIG_HZ=300 tick" },
+  { 4000000,    "CONFIG_HZ=250 tick" },
+  { 10000000,   "CONFIG_HZ=100 tick" },
+  { 1000000000, "1s timer, e.g. vmstat" },
+};
+
+
+static void write_periods(struct thread* t, FILE* f)
+{
+  const struct period* p;
+  unsigned j, k;
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    if( t[i].n_periods == 0 )
+      fprintf(f, "# period: core %d: none found\n", t[i].core_i);
+    for( j = 0; j < t[i].n_periods; ++j ) {
+      p = &(t[i].periods[j]);
+      fprintf(f, "# period: core %d: %.1f%% of int_total at %.3fms period",
+              t[i].core_i, p->share * 100, p->period_ns / 1e6);
+      for( k = 0; k < sizeof(known_periods) / sizeof(known_periods[0]); ++k )
+        if( p->period_ns > known_periods[k].period_ns * 0.98 &&
+            p->period_ns < known_periods[k].period_ns * 1.02 )
+          fprintf(f, " (likely %s)", known_periods[k].what);
+      fprintf(f, "\n");
+    }
+  }
+}
+
+
+
+#define _putfield(label, val, fmt) do {         \
+  printf("%s:", label);                         \
+  for( i = 0; i < g.n_threads; ++i )            \
+    printf(" %"fmt, val);                       \
+  printf("\n");                                 \
+} while( 0 )
+
+#define putfield(fn, fmt)  _putfield(#fn, t[i].fn, fmt)
+
+#define putu(fn)    putfield(fn, "u")
+#define put_frc(fn)  putfield(fn, PRIx64)
+#define put_cycles(fn)                                          \
+  _putfield(#fn"(ns)", cycles_to_ns(&(t[i]), t[i].fn), PRIu64)
+#define put_cycles_s(fn)                                        \
+  _putfield(#fn"(s)", cycles_to_sec_f(&(t[i]), t[i].fn), ".3f")
+#define put_percent(a, b)                                               \
+  _putfield(#a"(%)", (t[i].b ? (t[i].a * 1e2 / t[i].b) : 0.0), ".3f")
+
+
+/* Rate of each counter that moved on any measured core during the run. */
+static void write_attribution(struct thread* t)
+{
+  const struct counters* a = &g.attr_start;
+  const struct counters* b = &g.attr_stop;
+  const uint64_t* va;
+  const uint64_t* vb;
+  char label[48];
+  int i, j, k, moved;
+
+  for( j = 0; j < b->n; ++j ) {
+    for( k = 0; k < a->n; ++k )
+      if( strcmp(a->names[k], b->names[j]) == 0 )
+        break;
+    va = k < a->n ? &(a->vals[k * g.n_threads]) : NULL;
+    vb = &(b->vals[j * g.n_threads]);
+    for( moved = 0, i = 0; i < g.n_threads; ++i )
+      if( vb[i] != (va ? va[i] : 0) )
+        moved = 1;
+    if( ! moved )
+      continue;
+    snprintf(label, sizeof(label), "%s(/s)", b->names[j]);
+    _putfield(label, (vb[i] - (va ? va[i] : 0)) / g.attr_secs, ".3f");
+  }
+}
+
+
+static void write_bins(struct thread* t)
+{
+  char label[48];
+  unsigned b;
+  int i;
+
+  for( b = 0; b < g.n_bins; ++b ) {
+    if( b + 1 < g.n_bins )
+      snprintf(label, sizeof(label), "bin[%u,%u)(ns)",
+               g.bin_ns[b], g.bin_ns[b + 1]);
+    else
+      snprintf(label, sizeof(label), "bin[%u,inf)(ns)", g.bin_ns[b]);
+    _putfield(label, t[i].bin_n[b], PRIu64);
+  }
+}
+
+
+/* How many kept interruptions each kind of kernel event was seen in. */
+static void write_causes(struct thread* t)
+{
+  static const char* const names[] = SJ_CAUSE_NAMES;
+  char label[32];
+  int i, b;
+
+  for( b = 0; b < SJ_N_CAUSES; ++b ) {
+    snprintf(label, sizeof(label), "cause_%s", names[b]);
+    _putfield(label, t[i].cause_n[b], "u");
+  }
+  _putfield("cause_none", t[i].cause_none, "u");
+  _putfield("perf_lost", t[i].perf_lost, PRIu64);
+}
+
+
+/* Each --trigger event kept, with the interruptions before it. */
+static void write_triggers(struct thread* t, FILE* f)
+{
+  const struct trigger_event* e;
+  const struct thread* et;
+  unsigned k, c;
+
+  for( k = 0; k < g.n_trigger_events; ++k ) {
+    e = &(g.trigger_events[k]);
+    et = &(t[e->thread_i]);
+    fprintf(f, "# trigger: core %d at %"PRIu64"ns for %"PRIu64"ns\n",
+            et->core_i, cycles_to_ns(et, e->slot.event.ts - et->frc_start),
+            cycles_to_ns(et, e->slot.event.diff));
+    for( c = 0; c < e->slot.n_ctx; ++c )
+      fprintf(f, "#   before: at %"PRIu64"ns for %"PRIu64"ns\n",
+              cycles_to_ns(et, e->slot.ctx[c].ts - et->frc_start),
+              cycles_to_ns(et, e->slot.ctx[c].diff));
+  }
+}
+
+
+static void write_summary(struct thread* t, FILE* f)
+{
+  unsigned k;
+  int i;
+
+  putu(core_i);
+  _putfield("threshold(ns)", g.threshold_nsec, "u");
+  putfield(sched_policy, "s");
+  putu(cpu_mhz);
+  _putfield("clock", clock_names[g.clock], "s");
+  if( g.measure_offsets )
+    _putfield("clock_skew(ns)",
+              t[i].frc_offset * 1000 / (int64_t) t[i].cpu_mhz, PRId64);
+  if( g.msr ) {
+    putu(eff_mhz);
+    if( ! g.msr_no_smi )
+      putu(smi_count);
+  }
+  if( g.wakeup ) {
+    _putfield("wakeup_period(us)", g.wakeup_period_usec, "u");
+    putu(wakeups);
+  }
+  else if( g.walk_bytes ) {
+    printf("# walk: int_* exclude walk_iter, the undisturbed time per chunk\n");
+    put_cycles(walk_iter);
+  }
+  else {
+    put_cycles(loop_min);
+    put_cycles(loop_median);
+  }
+  put_cycles(runtime);
+  put_cycles_s(runtime);
+  putu(int_n);
+  _putfield("int_n_per_sec",
+            t[i].int_n / cycles_to_sec_f(&(t[i]), t[i].runtime), ".3f");
+  for( k = 0; k < SJ_STATS_N_FIELDS; ++k )
+    _putfield(sj_stats_fields[k].label, sj_stats_get(&(t[i].stats), k),
+              PRIu64);
+  _putfield("int_total(%)", t[i].stats.int_total_pc, ".3f");
+  if( g.show_steal ) {
+    _putfield("steal(ns)", t[i].steal, PRIu64);
+    _putfield("steal(%)", t[i].runtime ?
+              t[i].steal * 1e2 / cycles_to_ns(&(t[i]), t[i].runtime) : 0.0,
+              ".3f");
+  }
+  if( g.n_bins )
+    write_bins(t);
+  if( g.walk_bytes ) {
+    put_cycles(recov_total);
+    put_cycles(recov_mean);
+    put_cycles(recov_max);
+  }
+  if( g.stream )
+    putu(ring_dropped);
+  if( g.clock == SJ_CLOCK_RDTSCP )
+    putu(clock_migrations);
+  if( g.verbose ) {
+    put_frc(frc_start);
+    put_frc(frc_stop);
+    putfield(frc_offset, PRId64);
+    putfield(frc_offset_err, PRIu64);
+    /* When each core started, relative to the first, on a common clock. */
+    stamp_t first = (stamp_t) -1;
+    for( i = 0; i < g.n_threads; ++i )
+      if( t[i].frc_start - t[i].frc_offset < first )
+        first = t[i].frc_start - t[i].frc_offset;
+    _putfield("start_skew(ns)",
+              cycles_to_ns(&(t[i]), t[i].frc_start - t[i].frc_offset - first),
+              PRIu64);
+  }
+  if( g.attribute )
+    write_attribution(t);
+  if( g.perf )
+    write_causes(t);
+  if( g.coincide_k ) {
+    putu(int_coincident);
+    write_coincidences(t, f);
+  }
+  if( g.periodicity )
+    write_periods(t, f);
+  if( g.trigger_nsec ) {
+    _putfield("trigger(ns)", g.trigger_nsec, "u");
+    _putfield("trigger_n", t[i].trigger_slot.n, "u");
+    putu(trigger_missed);
+    write_triggers(t, f);
+  }
+}
+
+
+static void thread_postprocess(struct thread* t)
+{
+  if( g.perf )
+    perf_match(t);
+  thread_calc_stats(t);
+  if( g.periodicity )
+    find_periods(t);
+}
+
+
+static void* postprocess_main(void* arg)
+{
+  struct thread* t = arg;
+
+  /* Run on the core that measured so the data is (probably) numa-local. */
+  move_to_core(t->core_i);
+  thread_postprocess(t);
+  return NULL;
+}
+
+
+/* Calculate every thread's stats (sorting where needed) in parallel. */
+static void postprocess(struct thread* threads)
+{
+  pthread_t* tids;
+  int i;
+
+  TEST(tids = malloc(g.n_threads * sizeof(tids[0])));
+  for( i = 0; i < g.n_threads; ++i )
+    start_thread(&(tids[i]), postprocess_main, &(threads[i]));
+  for( i = 0; i < g.n_threads; ++i )
+    pthread_join(tids[i], NULL);
+  free(tids);
+}
+
+
+/* Wait for all measuring threads to get here.  Each thread only ever
+ * spins on its own flags, and there is no shared counter to fight over.
+ */
+static void barrier(struct thread* t)
+{
+  unsigned r, dist, me = t - g.threads, episode = ++(t->barrier_episode);
+  struct barrier_flag* partner;
+
+  for( r = 0, dist = 1; dist < g.n_threads; ++r, dist *= 2 ) {
+    partner = &(g.threads[(me + dist) % g.n_threads].barrier_flag[r]);
+    __atomic_store_n(&partner->episode, episode, __ATOMIC_RELEASE);
+    while( (int) (__atomic_load_n(&(t->barrier_flag[r].episode),
+                                  __ATOMIC_ACQUIRE) - episode) < 0 )
+      relax();
+  }
+}
+
+
+static void* thread_main(void* arg)
+{
+  /* Important thing to note here is that once we start bashing the CPU, we
+   * need to keep doing so to prevent the core from changing frequency or
+   * dropping into a low power state.
+   */
+  struct thread* t = arg;
+  int i, child = 2 * (t - g.threads) + 1;
+
+  /* Launch in a binary tree, so that start-up takes log(n_threads) thread
+   * creations rather than n_threads.
+   */
+  for( i = child; i < child + 2 && i < g.n_threads; ++i )
+    start_thread(&(g.threads[i].thread_id), thread_main, &(g.threads[i]));
+
+  /* Alloc memory in the thread itself after setting affinity to get the
+   * best chance of getting numa-local memory.  Doesn't matter so much for
+   * the "struct thread" since we expect that to stay cache resident.
+   */
+  TEST(move_to_core(t->core_i) == 0);
+  if( g.rt_policy != SCHED_OTHER &&
+      (errno = set_rt_sched(g.rt_policy, g.rt_prio)) != 0 ) {
+    fprintf(stderr, "%s: ERROR: Could not set %s scheduling on core %d (%s)\n",
+            APP_NAME, policy_name(g.rt_policy), t->core_i, strerror(errno));
+    /* The kernel only lets a deadline thread be pinned to a core that is
+     * a root domain of its own.
+     */
+    if( g.rt_policy == SCHED_DEADLINE && errno == EPERM && geteuid() == 0 )
+      fprintf(stderr, "%s: SCHED_DEADLINE threads can only be pinned to a "
+              "core that has a root domain of its own (an exclusive cpuset "
+              "partition holding just core %d)\n", APP_NAME, t->core_i);
+    else if( g.rt_policy == SCHED_DEADLINE && errno == EPERM )
+      fprintf(stderr, "%s: SCHED_DEADLINE needs root\n", APP_NAME);
+    else if( g.rt_policy == SCHED_DEADLINE )
+      fprintf(stderr, "%s: SCHED_DEADLINE needs enough bandwidth in "
+              "sched_rt_runtime_us\n", APP_NAME);
+    exit(2);
+  }
+  {
+    struct sched_param sp;
+    int policy = sched_getscheduler(0);
+    sched_getparam(0, &sp);
+    snprintf(t->sched_policy, sizeof(t->sched_policy), "%s:%d",
+             policy_name(policy), sp.sched_priority);
+  }
+  bind_local(t, sizeof(*t), MPOL_MF_MOVE);
+  thread_init(t);
+  if( g.perf && ! g.calibrating )
+    perf_open(t);
+  if( g.msr )
+    msr_open(t);
+  if( g.walk_bytes )
+    measure_walk_iter(t);
+  else if( ! g.wakeup )
+    measure_loop_floor(t);
+
+  /* Don't bash the cpu until all threads have got going.  Not until our
+   * children's thread_ids have been written, as the main thread will join
+   * them once every thread has got this far.
+   */
+  atomic_inc(&g.n_threads_started);
+  while( g.cmd == WAIT )
+    usleep(1000);
+
+  t->cpu_mhz = g.cpu_mhz ? g.cpu_mhz : sj_measure_cpu_mhz();
+  if( g.n_bins )
+    bins_init(t);
+  if( g.trigger_nsec && ! g.calibrating )
+    t->trigger_cycles = (cycles_t) g.trigger_nsec * t->cpu_mhz / 1000;
+
+  /* Ensure we all start at the same time. */
+  barrier(t);
+
+  if( t->perf_n )
+    perf_enable(t, 1);
+  if( g.msr )
+    msr_read(t, t->msr_start);
+  t->mono_start = mono_ns();
+  frc(&t->frc_start);
+  if( g.wakeup )
+    doit_wakeup(t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000,
+                g.store_raw);
+  else if( g.walk_bytes )
+    doit_walk(t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000,
+              g.store_raw);
+  else if( g.n_bins )
+    (g.store_raw ? g.loop->stored_bins : g.loop->unstored_bins)
+      (t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000);
+  else if( g.store_raw )
+    g.loop->stored(t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000);
+  else
+    g.loop->unstored(t, (cycles_t) g.threshold_nsec * t->cpu_mhz / 1000);
+  frc(&t->frc_stop);
+  t->mono_stop = mono_ns();
+  if( g.msr )
+    msr_stop(t);
+  if( t->perf_n )
+    perf_enable(t, 0);
+
+  /* Wait for everyone to finish so we don't disturb them by exiting and
+   * waking the main thread.
+   */
+  if( g.store_raw && ! g.calibrating &&
+      t->c_interruption - t->interruptions == g.max_interruptions )
+    g.overflow = 1;
+  barrier(t);
+  if( t == g.threads )
+    g.measure_done = 1;
+
+  /* Now nobody is measuring, each thread does its own post-processing on
+   * its own (numa-local) data, in parallel.
+   */
+  if( g.post_in_threads && ! g.calibrating && ! g.overflow ) {
+    thread_postprocess(t);
+    if( g.raw_prefix != NULL &&
+        write_thread_raw_file(t, g.raw_prefix, g.raw_core_digits) != 0 )
+      g.raw_err = 3;
+  }
+
+  return NULL;
+}
+
+
+/* Creates the --daemon segment.  Any left by an earlier run is replaced,
+ * and readers that still have it mapped see no more updates.  The magic
+ * is set by shm_start() when the run starts.
+ */
+static void shm_create(struct thread* threads)
+{
+  struct sj_shm_header* h;
+  struct sj_shm_core* c;
+  uint64_t* buckets;
+  size_t core_size;
+  unsigned b;
+  int fd, i;
+
+  core_size = ALIGN_UP(sizeof(*c) + 2 * SJ_HIST_N_BUCKETS * sizeof(c->counts[0]));
+  g.shm_bytes = ALIGN_UP(sizeof(*h) + SJ_HIST_N_BUCKETS * sizeof(buckets[0])) +
+    g.n_threads * core_size;
+  shm_unlink(SJ_SHM_NAME);
+  if( (fd = shm_open(SJ_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 ||
+      ftruncate(fd, g.shm_bytes) < 0 ||
+      (h = mmap(NULL, g.shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0)) == MAP_FAILED ) {
+    fprintf(stderr, "%s: ERROR: Could not create /dev/shm%s (%s)\n",
+            APP_NAME, SJ_SHM_NAME, strerror(errno));
+    exit(3);
+  }
+  close(fd);
+
+  h->version = SJ_SHM_VERSION;
+  h->n_cores = g.n_threads;
+  h->n_buckets = SJ_HIST_N_BUCKETS;
+  h->threshold_nsec = g.threshold_nsec;
+  h->buckets_off = sizeof(*h);
+  h->cores_off = ALIGN_UP(sizeof(*h) + SJ_HIST_N_BUCKETS * sizeof(buckets[0]));
+  h->core_size = core_size;
+  h->interval_nsec = g.interval_secs * 1e9;
+  buckets = (void*) ((char*) h + h->buckets_off);
+  for( b = 0; b < SJ_HIST_N_BUCKETS; ++b )
+    buckets[b] = sj_hist_bucket_max(b);
+  for( i = 0; i < g.n_threads; ++i ) {
+    c = sj_shm_core(h, i);
+    c->core_i = threads[i].core_i;
+  }
+  g.shm = h;
+}
+
+
+/* Completes the --daemon header, which does not change after this. */
+static void shm_start(void)
+{
+  g.shm->start_ns = (uint64_t) g.tv_start.tv_sec * 1000000000 +
+    g.tv_start.tv_usec * 1000;
+  /* Readers check the magic last. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(g.shm->magic, SJ_SHM_MAGIC, sizeof(SJ_SHM_MAGIC));
+}
+
+
+/* The reporter is the only writer, so the measuring threads never wait. */
+static void shm_publish(const struct thread* t, unsigned i,
+                        const struct sj_histogram* total,
+                        const struct sj_histogram* d, uint64_t n,
+                        cycles_t max, int window)
+{
+  struct sj_shm_core* c = sj_shm_core(g.shm, i);
+  uint32_t seq = c->seq;
+  struct timespec ts;
+  unsigned b;
+
+  __atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  c->cpu_mhz = t->cpu_mhz;
+  c->update_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  c->n_intervals = window;
+  c->interval_int_n = n;
+  c->interval_int_max = max;
+  c->int_n += n;
+  if( max > c->int_max )
+    c->int_max = max;
+  for( b = 0; b < SJ_HIST_N_BUCKETS; ++b ) {
+    c->counts[b] = total->counts[b];
+    c->counts[SJ_HIST_N_BUCKETS + b] = d->counts[b];
+  }
+  __atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/* Print stats for the window since the last report, worked out from the
+ * change in each thread's histogram since [prev].  The histograms are read
+ * without any locking, so a report may be out by the odd interruption.
+ */
+static void report_interval(struct thread* threads, struct sj_histogram* prev,
+                            uint64_t* prev_steal, struct sj_histogram* d,
+                            int window, double secs)
+{
+  uint64_t steal[g.n_threads];
+  FILE* f = g.interval_f;
+  uint64_t n[g.n_threads], c, cum, rank;
+  cycles_t p99[g.n_threads], max[g.n_threads];
+  struct thread* t;
+  unsigned b;
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    n[i] = 0;
+    max[i] = 0;
+    for( b = 0; b < SJ_HIST_N_BUCKETS; ++b ) {
+      c = __atomic_load_n(&(threads[i].hist->counts[b]), __ATOMIC_RELAXED);
+      d->counts[b] = c - prev[i].counts[b];
+      prev[i].counts[b] = c;
+      n[i] += d->counts[b];
+      if( d->counts[b] )
+        max[i] = sj_hist_bucket_max(b);
+    }
+    rank = (uint64_t) (n[i] * 0.99);
+    p99[i] = 0;
+    for( cum = 0, b = 0; n[i] && b < SJ_HIST_N_BUCKETS; ++b )
+      if( (cum += d->counts[b]) > rank ) {
+        p99[i] = sj_hist_bucket_max(b);
+        break;
+      }
+    if( g.shm != NULL )
+      shm_publish(&(threads[i]), i, &(prev[i]), d, n[i], max[i], window);
+  }
+
+#ifdef SYSJITTER_MPI
+  if( window <= g.n_windows ) {
+    uint64_t w = 0;
+    for( i = 0; i < g.n_threads; ++i )
+      if( threads[i].cpu_mhz && cycles_to_ns(&(threads[i]), max[i]) > w )
+        w = cycles_to_ns(&(threads[i]), max[i]);
+    g.window_max_ns[window - 1] = w;
+    g.n_windows_done = window;
+  }
+#endif
+  if( g.interval_quiet )
+    return;
+  fprintf(f, "# interval %d ending at %.3fs\n", window, secs);
+  fprintf(f, "core_i:");
+  for( i = 0; i < g.n_threads; ++i )
+    fprintf(f, " %d", threads[i].core_i);
+  fprintf(f, "\nint_n:");
+  for( i = 0; i < g.n_threads; ++i )
+    fprintf(f, " %"PRIu64, n[i]);
+  fprintf(f, "\nint_99(ns):");
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    fprintf(f, " %"PRIu64, t->cpu_mhz ? cycles_to_ns(t, p99[i]) : 0);
+  }
+  fprintf(f, "\nint_max(ns):");
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    fprintf(f, " %"PRIu64, t->cpu_mhz ? cycles_to_ns(t, max[i]) : 0);
+  }
+  if( g.show_steal ) {
+    read_steal(threads, steal);
+    fprintf(f, "\nsteal(ns):");
+    for( i = 0; i < g.n_threads; ++i ) {
+      fprintf(f, " %"PRIu64, steal[i] - prev_steal[i]);
+      prev_steal[i] = steal[i];
+    }
+  }
+  fprintf(f, "\n");
+  fflush(f);
+}
+
+
+static void* reporter_main(void* arg)
+{
+  struct thread* threads = arg;
+  struct sj_histogram* prev;
+  struct sj_histogram* d;
+  struct timespec next, now;
+  uint64_t* prev_steal;
+  int window = 0;
+  double secs;
+
+  /* Not on a measured core, please. */
+  TEST(move_to_core(g.housekeeping_core) == 0);
+  TEST(prev = calloc(g.n_threads, sizeof(*prev)));
+  TEST(d = malloc(sizeof(*d)));
+  TEST(prev_steal = malloc(g.n_threads * sizeof(prev_steal[0])));
+  read_steal(threads, prev_steal);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  now = next;
+
+  pthread_mutex_lock(&g.reporter_lock);
+  while( g.reporter_run ) {
+    secs = g.interval_secs * (window + 1);
+    next.tv_sec = now.tv_sec + (time_t) secs;
+    next.tv_nsec = now.tv_nsec + (long) ((secs - (time_t) secs) * 1e9);
+    if( next.tv_nsec >= 1000000000 ) {
+      next.tv_sec += 1;
+      next.tv_nsec -= 1000000000;
+    }
+    if( pthread_cond_timedwait(&g.reporter_cond, &g.reporter_lock,
+                               &next) == ETIMEDOUT && g.reporter_run ) {
+      pthread_mutex_unlock(&g.reporter_lock);
+      report_interval(threads, prev, prev_steal, d, ++window, secs);
+      pthread_mutex_lock(&g.reporter_lock);
+    }
+  }
+  pthread_mutex_unlock(&g.reporter_lock);
+  free(prev_steal);
+  free(d);
+  free(prev);
+  return NULL;
+}
+
+
+/* Opens a file in the tracefs mount, wherever that is. */
+static int tracefs_open(const char* name)
+{
+  static const char* const dirs[] = {
+    "/sys/kernel/tracing", "/sys/kernel/debug/tracing",
+  };
+  char path[64];
+  unsigned k;
+  int fd;
+
+  for( k = 0; k < sizeof(dirs) / sizeof(dirs[0]); ++k ) {
+    snprintf(path, sizeof(path), "%s/%s", dirs[k], name);
+    if( (fd = open(path, O_WRONLY)) >= 0 )
+      return fd;
+  }
+  return -1;
+}
+
+
+/* Takes --trigger events from the measuring threads, marks them in the
+ * ftrace buffer (or stops tracing, so the buffer keeps what led up to
+ * them) and keeps them for the report.
+ */
+static void* trigger_main(void* arg)
+{
+  struct thread* threads = arg;
+  struct trigger_slot* s;
+  struct thread* t;
+  char msg[128];
+  int i, len, last, fired;
+  unsigned poll_us = TRIGGER_POLL_MIN_US;
+
+  /* Not on a measured core, please.  The measuring threads can't make a
+   * syscall to wake us, so we poll, backing off while nothing happens.
+   */
+  TEST(move_to_core(g.housekeeping_core) == 0);
+  do {
+    /* Once more round after being stopped, to empty the slots. */
+    last = ! g.trigger_run;
+    fired = 0;
+    for( i = 0; i < g.n_threads; ++i ) {
+      t = &(threads[i]);
+      s = &(t->trigger_slot);
+      if( ! __atomic_load_n(&s->full, __ATOMIC_ACQUIRE) )
+        continue;
+      if( g.trace_marker_fd >= 0 ) {
+        len = snprintf(msg, sizeof(msg), "sysjitter: core %d interrupted "
+                       "for %"PRIu64"ns\n",
+                       t->core_i, cycles_to_ns(t, s->event.diff));
+        if( write(g.trace_marker_fd, msg, len) < 0 )
+          fprintf(stderr, "%s: WARNING: Could not write trace_marker (%s)\n",
+                  APP_NAME, strerror(errno));
+      }
+      if( g.tracing_on_fd >= 0 ) {
+        if( write(g.tracing_on_fd, "0", 1) < 0 )
+          fprintf(stderr, "%s: WARNING: Could not stop tracing (%s)\n",
+                  APP_NAME, strerror(errno));
+        close(g.tracing_on_fd);
+        g.tracing_on_fd = -1;
+      }
+      if( g.n_trigger_events < TRIGGER_MAX_EVENTS ) {
+        g.trigger_events[g.n_trigger_events].thread_i = i;
+        g.trigger_events[g.n_trigger_events].slot = *s;
+        ++g.n_trigger_events;
+      }
+      ++(s->n);
+      __atomic_store_n(&s->full, 0, __ATOMIC_RELEASE);
+      fired = 1;
+    }
+    if( fired )
+      poll_us = TRIGGER_POLL_MIN_US;
+    else if( poll_us < TRIGGER_POLL_MAX_US )
+      poll_us *= 2;
+    if( ! last )
+      usleep(poll_us);
+  } while( ! last );
+  return NULL;
+}
+
+
+static void* load_main(void* arg)
+{
+  struct load_thread* lt = arg;
+  char path[] = "/tmp/sysjitter-load-XXXXXX";
+  char* buf = NULL;
+  size_t bytes, k;
+  int fd = -1;
+  char* p;
+
+  TEST(move_to_core(lt->core_i) == 0);
+  switch( lt->kind ) {
+  case LOAD_MEMBW:
+    TEST(buf = malloc(LOAD_MEMBW_BYTES));
+    memset(buf, 1, LOAD_MEMBW_BYTES);
+    break;
+  case LOAD_IO:
+    TEST(buf = malloc(LOAD_IO_BYTES));
+    memset(buf, 1, LOAD_IO_BYTES);
+    TEST((fd = mkstemp(path)) >= 0);
+    unlink(path);
+    break;
+  default:
+    break;
+  }
+
+  while( g.cmd == WAIT )
+    relax();
+  while( ! g.load_stop ) {
+    switch( lt->kind ) {
+    case LOAD_MEMBW:
+      /* Read and write the buffer, half at a time. */
+      bytes = LOAD_MEMBW_BYTES / 2;
+      memcpy(buf, buf + bytes, bytes);
+      memcpy(buf + bytes, buf, bytes);
+      break;
+    case LOAD_SYSCALL:
+      for( k = 0; k < 1000; ++k )
+        syscall(SYS_getppid);
+      break;
+    case LOAD_IO:
+      for( k = 0; k < LOAD_IO_BLOCKS; ++k )
+        if( pwrite(fd, buf, LOAD_IO_BYTES, k * LOAD_IO_BYTES) < 0 )
+          break;
+      for( k = 0; k < LOAD_IO_BLOCKS; ++k )
+        if( pread(fd, buf, LOAD_IO_BYTES, k * LOAD_IO_BYTES) < 0 )
+          break;
+      break;
+    case LOAD_TLB:
+      /* Changing our own mappings while the measuring threads are running
+       * in the same mm makes the kernel flush their TLBs too.
+       */
+      p = mmap(NULL, LOAD_TLB_BYTES, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if( p == MAP_FAILED )
+        break;
+      for( k = 0; k < LOAD_TLB_BYTES; k += 4096 )
+        p[k] = 1;
+      mprotect(p, LOAD_TLB_BYTES, PROT_READ);
+      munmap(p, LOAD_TLB_BYTES);
+      break;
+    }
   }
+
+  if( fd >= 0 )
+    close(fd);
+  free(buf);
+  return NULL;
 }
 
 
-static void write_thread_raw(struct thread* t, FILE* f)
+/* Starts a thread on each --load core.  They start working on GO. */
+static void load_start(void)
 {
-  int j, n_interruptions = (int) (t->c_interruption - t->interruptions);
-  const struct interruption* i;
-  const struct interruption* prev;
-  cycles_t delta;
+  unsigned i;
 
-  fprintf(f, "# cpu_mhz: %u\n", t->cpu_mhz);
-  fprintf(f, "# threshold: %uns\n", g.threshold_nsec);
-  fprintf(f, "# n_interruptions: %d\n", n_interruptions);
-  if( n_interruptions == 0 )
-    return;
-  delta = t->frc_stop - t->frc_start;
-  fprintf(f, "# interruption: %f%%\n", 100.0 * t->int_total / delta);
-  fprintf(f, "# total_interruption: %"PRId64" cycles\n", t->int_total);
-  fprintf(f, "# total_runtime: %"PRIu64" cycles\n", delta);
-  fprintf(f, "# total_interruption: %.9f seconds\n",
-          cycles_to_sec_f(t, t->int_total));
-  fprintf(f, "# total_runtime: %.9f seconds\n", cycles_to_sec_f(t, delta));
-  fprintf(f, "#\n");
+  g.load_stop = 0;
+  for( i = 0; i < g.n_load_threads; ++i )
+    start_thread(&(g.load_threads[i].thread_id), load_main,
+                 &(g.load_threads[i]));
+}
 
-  if( ! g.sort_raw ) {
-    fprintf(f, "#      Timestamp      delta   <== interruption =>\n");
-    fprintf(f, "#         (nsec)     (usec)   (cycles)     (nsec)\n");
-    /*         "1234567890123456 1234567890 1234567890 1234567890" */
 
-    i = prev = t->interruptions;
-    for( ; i < t->c_interruption; prev = i, ++i ) {
-      delta = i->ts - prev->ts;
-      fprintf(f, "%16"PRIu64" %10"PRIu64" %10"PRId64" %10"PRIu64"\n",
-              cycles_to_ns(t, i->ts - t->frc_start),
-              cycles_to_us(t, delta), i->diff, cycles_to_ns(t, i->diff));
+static void load_finish(void)
+{
+  unsigned i;
+
+  g.load_stop = 1;
+  for( i = 0; i < g.n_load_threads; ++i )
+    pthread_join(g.load_threads[i].thread_id, NULL);
+}
+
+
+static void run_expt(struct thread* threads, int runtime_secs,
+                     int calibrating)
+{
+  pthread_t collector, reporter, trigger;
+  int i;
+
+  g.runtime_secs = runtime_secs;
+  g.calibrating = calibrating;
+  g.n_threads_started = 0;
+  g.measure_done = 0;
+  g.overflow = 0;
+  g.cmd = WAIT;
+
+  /* The threads start each other (see thread_main()). */
+  start_thread(&(threads[0].thread_id), thread_main, &(threads[0]));
+  while( g.n_threads_started != g.n_threads )
+    usleep(1000);
+  if( g.loading )
+    load_start();
+  if( g.stream ) {
+    g.collector_run = 1;
+    start_thread(&collector, collector_main, threads);
+  }
+  if( g.attribute && ! calibrating )
+    attribute_snapshot(&g.attr_start, threads);
+#ifdef SYSJITTER_MPI
+  /* Start all nodes together so that the interval windows line up. */
+  if( ! calibrating ) {
+    memset(g.window_max_ns, 0, g.n_windows * sizeof(g.window_max_ns[0]));
+    g.n_windows_done = 0;
+    MPI_Barrier(MPI_COMM_WORLD);
+  }
+#endif
+  if( ! calibrating ) {
+    uint64_t steal[g.n_threads];
+    read_steal(threads, steal);
+    for( i = 0; i < g.n_threads; ++i )
+      threads[i].steal_start = steal[i];
+  }
+  gettimeofday(&g.tv_start, NULL);
+  if( g.shm != NULL && ! calibrating )
+    shm_start();
+  g.cmd = GO;
+  if( g.interval_secs > 0 && ! calibrating ) {
+    g.reporter_run = 1;
+    start_thread(&reporter, reporter_main, threads);
+  }
+  if( g.trigger_nsec && ! calibrating ) {
+    g.n_trigger_events = 0;
+    g.trigger_run = 1;
+    start_thread(&trigger, trigger_main, threads);
+  }
+
+  alarm(g.runtime_secs);
+
+  /* Go to sleep until the threads have done their stuff.  They may go on
+   * to post-process, but that shouldn't count towards the run.
+   */
+  while( ! g.measure_done )
+    usleep(1000);
+  if( g.loading )
+    load_finish();
+  if( ! calibrating ) {
+    uint64_t steal[g.n_threads];
+    read_steal(threads, steal);
+    for( i = 0; i < g.n_threads; ++i ) {
+      threads[i].steal = steal[i] - threads[i].steal_start;
+      if( threads[i].steal )
+        g.show_steal = 1;
     }
   }
+  if( g.attribute && ! calibrating ) {
+    struct timeval tv_stop;
+    gettimeofday(&tv_stop, NULL);
+    attribute_snapshot(&g.attr_stop, threads);
+    g.attr_secs = tv_stop.tv_sec - g.tv_start.tv_sec +
+      (tv_stop.tv_usec - g.tv_start.tv_usec) / 1e6;
+  }
+  if( g.interval_secs > 0 && ! calibrating ) {
+    pthread_mutex_lock(&g.reporter_lock);
+    g.reporter_run = 0;
+    pthread_cond_signal(&g.reporter_cond);
+    pthread_mutex_unlock(&g.reporter_lock);
+    pthread_join(reporter, NULL);
+  }
+  for( i = 0; i < g.n_threads; ++i )
+    pthread_join(threads[i].thread_id, NULL);
+  if( g.trigger_nsec && ! calibrating ) {
+    g.trigger_run = 0;
+    pthread_join(trigger, NULL);
+  }
+  if( g.stream ) {
+    g.collector_run = 0;
+    pthread_join(collector, NULL);
+  }
   else {
-    fprintf(f, "#      Timestamp   <== interruption =>\n");
-    fprintf(f, "#         (nsec)   (cycles)     (nsec)\n");
-    /*         "1234567890123456 1234567890 1234567890" */
+    post_test_checks(threads);
+  }
+}
 
-    sort_interruptions(t);
-    for( j = 0; j < n_interruptions; ++j ) {
-      i = t->sorted[j];
-      fprintf(f, "%16"PRIu64" %10"PRId64" %10"PRIu64"\n",
-              cycles_to_ns(t, i->ts - t->frc_start),
-              i->diff, cycles_to_ns(t, i->diff));
-    }
+
+/* Frees what a run produced, but keeps each thread's arena for the next
+ * trial.
+ */
+static void reset_expt(struct thread* threads)
+{
+  int i;
+  for( i = 0; i < g.n_threads; ++i ) {
+    /* Gathered interruptions are not part of the arena. */
+    if( g.gather )
+      free(threads[i].interruptions);
+    threads[i].interruptions = NULL;
+    free(threads[i].sorted);
+    threads[i].sorted = NULL;
+    threads[i].c_interruption = NULL;
+    threads[i].gather_cap = 0;
+    perf_close(&(threads[i]));
   }
 }
 
 
-static int write_raw(struct thread* threads, const char* outf)
+static void cleanup_expt(struct thread* threads)
 {
-  char fname[strlen(outf) + 10];
-  FILE* f;
-  int i, core_digits, max_core_i = -1;
-  int rc = 0;
+  int i;
+  reset_expt(threads);
+  for( i = 0; i < g.n_threads; ++i ) {
+    buf_free(threads[i].arena, threads[i].arena_bytes);
+    threads[i].arena = NULL;
+    threads[i].ring = NULL;
+    threads[i].hist = NULL;
+  }
+}
 
-  /* Find out max core_i so we can pad the core_i in the filename to the
-   * appropriate width.
+
+static void calc_max_interruptions(struct thread* threads, int runtime)
+{
+  /* Calculate how big max_interruptions needs to be for real run of
+   * [runtime] seconds.
+   */
+  struct thread* t;
+  int i, max = 0, per_sec;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    if( t->int_n > max )
+      max = t->int_n;
+  }
+
+  /* If getting a low number of interruptions per second then variance may be
+   * quite high.  So
    */
+  per_sec = max / g.runtime_secs;
+  if( per_sec < 1000 )
+    per_sec = 1000;
+  g.max_interruptions = per_sec * 2 * runtime;
+}
+
+
+static void handle_alarm(int code)
+{
+  int i;
+  g.cmd = STOP;
   for( i = 0; i < g.n_threads; ++i )
-    if( threads[i].core_i > max_core_i )
-      max_core_i = threads[i].core_i;
-  sprintf(fname, "%d%n", max_core_i, &core_digits);
+    g.threads[i].stop = 1;
+}
+
+
+/* Matches "NAME VALUE" or "NAME=VALUE".  Returns VALUE (consuming it from
+ * the argument list) or NULL if the option doesn't match.
+ */
+static const char* opt_val(const char* name, int* argc, char*** argv)
+{
+  size_t len = strlen(name);
+  const char* arg = (*argv)[0];
+
+  if( strncmp(arg, name, len) != 0 )
+    return NULL;
+  if( arg[len] == '=' )
+    return arg + len + 1;
+  if( arg[len] != '\0' || *argc < 2 )
+    return NULL;
+  --*argc;
+  ++*argv;
+  return (*argv)[0];
+}
+
+
+/* Says which --load generators were running for the results that follow. */
+static void write_load_header(void)
+{
+  unsigned i;
+
+  printf("# load:");
+  if( ! g.loading )
+    printf(" none");
+  for( i = 0; g.loading && i < g.n_loads; ++i )
+    printf(" %s", g.loads[i].arg);
+  printf("\n");
+}
+
+
+/* Does a run, and writes the raw files and summary.  Returns non-zero if
+ * writing raw output failed.
+ */
+static int measure_once(struct thread* threads, int runtime)
+{
+  int err = 0;
+
+  if( g.stream && ! g.gather )
+    err = stream_open(threads);
+  g.raw_err = 0;
+  run_expt(threads, runtime, 0);
+  if( g.stream && ! g.gather )
+    stream_close(threads);
+
+  /* Without streaming the measuring threads have already done this. */
+  if( ! g.post_in_threads ) {
+    postprocess(threads);
+    if( g.keep_raw && g.raw_prefix != NULL )
+      err = write_raw(threads, g.raw_prefix);
+  }
+  else if( g.raw_err ) {
+    err = g.raw_err;
+  }
+  if( g.coincide_k )
+    find_coincidences(threads);
+  return err;
+}
+
+
+static int double_cmp(const void* a, const void* b)
+{
+  double da = *(const double*) a;
+  double db = *(const double*) b;
+  return (da > db) - (da < db);
+}
+
+
+/* Median, min and max over the trials of one field of trial_result. */
+static void write_trial_field(struct thread* t, const char* name,
+                              const char* unit, size_t off)
+{
+  double col[g.n_trials], med[g.n_threads], lo[g.n_threads], hi[g.n_threads];
+  unsigned k, n = g.n_trials;
+  char label[48];
+  int i;
+
+  for( i = 0; i < g.n_threads; ++i ) {
+    for( k = 0; k < n; ++k )
+      col[k] = *(const double*) ((const char*)
+                                 &(g.trial_results[k * g.n_threads + i]) + off);
+    qsort(col, n, sizeof(col[0]), double_cmp);
+    med[i] = (n & 1) ? col[n / 2] : (col[n / 2 - 1] + col[n / 2]) / 2;
+    lo[i] = col[0];
+    hi[i] = col[n - 1];
+  }
+  snprintf(label, sizeof(label), "%s_median(%s)", name, unit);
+  _putfield(label, med[i], ".3f");
+  snprintf(label, sizeof(label), "%s_min(%s)", name, unit);
+  _putfield(label, lo[i], ".3f");
+  snprintf(label, sizeof(label), "%s_max(%s)", name, unit);
+  _putfield(label, hi[i], ".3f");
+}
+
+
+static void write_trials(struct thread* t)
+{
+  int i;
+
+  putu(core_i);
+  _putfield("trials", g.n_trials, "u");
+  write_trial_field(t, "int_99", "ns",
+                    offsetof(struct trial_result, int_99_ns));
+  write_trial_field(t, "int_9999", "ns",
+                    offsetof(struct trial_result, int_9999_ns));
+  write_trial_field(t, "int_total", "%",
+                    offsetof(struct trial_result, int_total_pc));
+}
+
+
+/* Runs the --trials, each with the buffers of the first.  A single trial
+ * prints the usual summary; more print it only with --verbose, followed
+ * by the spread of the headline numbers across the trials.
+ */
+static int measure(struct thread* threads, int runtime)
+{
+  const char* raw_prefix = g.raw_prefix;
+  char trial_prefix[raw_prefix ? strlen(raw_prefix) + 16 : 1];
+  struct trial_result* r;
+  unsigned k;
+  int i, rc, err = 0;
+
+  if( g.n_loads )
+    write_load_header();
+  for( k = 0; k < g.n_trials; ++k ) {
+    if( k ) {
+      reset_expt(threads);
+      usleep(g.trial_gap_secs * 1e6);
+    }
+    if( raw_prefix != NULL && g.n_trials > 1 ) {
+      sprintf(trial_prefix, "%s-trial%u", raw_prefix, k);
+      g.raw_prefix = trial_prefix;
+    }
+    rc = measure_once(threads, runtime);
+    g.raw_prefix = raw_prefix;
+    if( ! err )
+      err = rc;
+    if( g.n_trials == 1 ) {
+      write_summary(threads, stdout);
+      break;
+    }
+    for( i = 0; i < g.n_threads; ++i ) {
+      struct thread* t = &(threads[i]);
+      r = &(g.trial_results[k * g.n_threads + i]);
+      r->int_99_ns = t->stats.int_99;
+      r->int_9999_ns = t->stats.int_9999;
+      r->int_total_pc = t->stats.int_total_pc;
+    }
+    if( g.verbose ) {
+      printf("# trial: %u\n", k);
+      write_summary(threads, stdout);
+    }
+  }
+  if( g.n_trials > 1 )
+    write_trials(threads);
+  return err;
+}
+
+
+/* Numbers kept by --save-baseline and checked by --compare, with the
+ * pNN aliases accepted by --max-regress.
+ */
+enum metric {
+  M_INT_N_PER_SEC,
+  M_INT_MEDIAN,
+  M_INT_90,
+  M_INT_99,
+  M_INT_999,
+  M_INT_9999,
+  M_INT_99999,
+  M_INT_MAX,
+  M_INT_TOTAL,
+  N_METRICS
+};
+
+static const char* const metric_names[N_METRICS] = {
+  "int_n_per_sec", "int_median(ns)", "int_90(ns)", "int_99(ns)",
+  "int_999(ns)", "int_9999(ns)", "int_99999(ns)", "int_max(ns)",
+  "int_total(%)",
+};
+
+static const char* const metric_aliases[N_METRICS] = {
+  "rate", "p50", "p90", "p99", "p99.9", "p99.99", "p99.999", "max", NULL,
+};
+
+
+static double metric_value(const struct thread* t, enum metric m)
+{
+  switch( m ) {
+  case M_INT_N_PER_SEC:
+    return t->runtime ? t->int_n / cycles_to_sec_f(t, t->runtime) : 0.0;
+  case M_INT_MEDIAN:  return t->stats.int_median;
+  case M_INT_90:      return t->stats.int_90;
+  case M_INT_99:      return t->stats.int_99;
+  case M_INT_999:     return t->stats.int_999;
+  case M_INT_9999:    return t->stats.int_9999;
+  case M_INT_99999:   return t->stats.int_99999;
+  case M_INT_MAX:     return t->stats.int_max;
+  case M_INT_TOTAL:   return t->stats.int_total_pc;
+  default:
+    return 0.0;
+  }
+}
+
+
+/* Accepts the summary row name with or without its unit, or an alias. */
+static int metric_lookup(const char* name)
+{
+  size_t len;
+  int m;
+
+  for( m = 0; m < N_METRICS; ++m ) {
+    len = strcspn(metric_names[m], "(");
+    if( strcmp(name, metric_names[m]) == 0 ||
+        (strlen(name) == len && strncmp(name, metric_names[m], len) == 0) ||
+        (metric_aliases[m] && strcmp(name, metric_aliases[m]) == 0) )
+      return m;
+  }
+  return -1;
+}
+
+
+/* Parses --max-regress METRIC=LIMIT[%],...  A limit with % is relative to
+ * the baseline, else it is the allowed increase in the metric's units.
+ */
+static bool parse_regress(const char* arg)
+{
+  char* csr = strdupa(arg);
+  char *saveptr = NULL, *t, *eq, *end;
+  struct regress_limit* r;
+  int m;
+
+  g.n_regress = 0;
+  while( (t = strtok_r(csr, ",", &saveptr)) != NULL ) {
+    csr = NULL;
+    if( (eq = strchr(t, '=')) == NULL || g.n_regress == MAX_REGRESS )
+      return false;
+    *eq = '\0';
+    if( (m = metric_lookup(t)) < 0 )
+      return false;
+    r = &(g.regress[g.n_regress++]);
+    r->metric = m;
+    r->limit = strtod(eq + 1, &end);
+    r->relative = *end == '%';
+    if( end == eq + 1 || r->limit < 0 || strcmp(end, r->relative ? "%" : "") )
+      return false;
+  }
+  return g.n_regress > 0;
+}
+
+
+/* The baseline is plain text, one record per line:
+ *
+ *   sysjitter-baseline VERSION
+ *   threshold(ns) NSEC
+ *   metric CORE NAME VALUE
+ *   hist CORE BUCKET_MAX_NS COUNT
+ *
+ * Readers skip records and metrics they don't know.
+ */
+static int save_baseline(struct thread* threads, const char* path)
+{
+  const struct thread* t;
+  FILE* f;
+  unsigned b;
+  int i, m;
+
+  if( (f = fopen(path, "w")) == NULL ) {
+    fprintf(stderr, "%s: ERROR: Could not open '%s' for writing (%s)\n",
+            APP_NAME, path, strerror(errno));
+    return 3;
+  }
+  fprintf(f, "sysjitter-baseline %d\n", BASELINE_VERSION);
+  fprintf(f, "threshold(ns) %u\n", g.threshold_nsec);
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    for( m = 0; m < N_METRICS; ++m )
+      fprintf(f, "metric %d %s %.3f\n",
+              t->core_i, metric_names[m], metric_value(t, m));
+    for( b = 0; t->hist != NULL && b < SJ_HIST_N_BUCKETS; ++b )
+      if( t->hist->counts[b] )
+        fprintf(f, "hist %d %"PRIu64" %"PRIu64"\n", t->core_i,
+                cycles_to_ns(t, sj_hist_bucket_max(b)), t->hist->counts[b]);
+  }
+  if( fclose(f) != 0 ) {
+    fprintf(stderr, "%s: ERROR: Could not write '%s' (%s)\n",
+            APP_NAME, path, strerror(errno));
+    return 3;
+  }
+  return 0;
+}
+
+
+/* Checks this run against the --max-regress limits.  Returns 4 if any
+ * core is over a limit, having printed each offending metric.
+ */
+static int compare_baseline(struct thread* threads, const char* path)
+{
+  char line[256], name[64];
+  const struct thread* t;
+  double base[g.n_threads][N_METRICS], v, cur, lim;
+  bool have[g.n_threads][N_METRICS];
+  unsigned k, n_bad = 0, version;
+  int i, m, core;
+  FILE* f;
+
+  if( (f = fopen(path, "r")) == NULL ) {
+    fprintf(stderr, "%s: ERROR: Could not open '%s' (%s)\n",
+            APP_NAME, path, strerror(errno));
+    return 3;
+  }
+  if( fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "sysjitter-baseline %u", &version) != 1 ||
+      version == 0 || version > BASELINE_VERSION ) {
+    fprintf(stderr, "%s: ERROR: '%s' is not a sysjitter baseline\n",
+            APP_NAME, path);
+    fclose(f);
+    return 3;
+  }
+  memset(have, 0, sizeof(have));
+  while( fgets(line, sizeof(line), f) != NULL ) {
+    if( sscanf(line, "metric %d %63s %lf", &core, name, &v) != 3 ||
+        (m = metric_lookup(name)) < 0 )
+      continue;
+    for( i = 0; i < g.n_threads; ++i )
+      if( threads[i].core_i == core ) {
+        base[i][m] = v;
+        have[i][m] = true;
+      }
+  }
+  fclose(f);
 
   for( i = 0; i < g.n_threads; ++i ) {
-    sprintf(fname, "%s.%0*d", outf, core_digits, threads[i].core_i);
-    if( (f = fopen(fname, "w")) == NULL ) {
-      fprintf(stderr, "%s: ERROR: Could not open '%s' for writing (%s)\n",
-              APP_NAME, fname, strerror(errno));
-      rc = 3;
-      continue;
+    t = &(threads[i]);
+    for( k = 0; k < g.n_regress; ++k ) {
+      m = g.regress[k].metric;
+      if( ! have[i][m] ) {
+        fprintf(stderr, "%s: WARNING: No baseline %s for core %d\n",
+                APP_NAME, metric_names[m], t->core_i);
+        continue;
+      }
+      cur = metric_value(t, m);
+      lim = g.regress[k].relative ?
+        base[i][m] * (1 + g.regress[k].limit / 100) :
+        base[i][m] + g.regress[k].limit;
+      if( cur > lim ) {
+        fprintf(stderr, "%s: REGRESSION: core %d %s %.3f > %.3f "
+                "(baseline %.3f)\n", APP_NAME, t->core_i, metric_names[m],
+                cur, lim, base[i][m]);
+        ++n_bad;
+      }
     }
-    write_thread_raw(&(threads[i]), f);
-    fclose(f);
   }
-  return rc;
+  return n_bad ? 4 : 0;
 }
 
 
-#define _putfield(label, val, fmt) do {         \
-  printf("%s:", label);                         \
-  for( i = 0; i < g.n_threads; ++i )            \
-    printf(" %"fmt, val);                       \
-  printf("\n");                                 \
-} while( 0 )
-
-#define putfield(fn, fmt)  _putfield(#fn, t[i].fn, fmt)
+/* Parses the --bins edges, which must be increasing.  "log" gives a 1-2-5
+ * series from 100ns to 100ms.
+ */
+static bool parse_bins(const char* arg)
+{
+  static const unsigned steps[] = { 1, 2, 5 };
+  char* csr = strdupa(arg);
+  char *saveptr = NULL, *t;
+  unsigned v, decade;
+  char dummy;
 
-#define putu(fn)    putfield(fn, "u")
-#define put_frc(fn)  putfield(fn, PRIx64)
-#define put_cycles(fn)                                          \
-  _putfield(#fn"(ns)", cycles_to_ns(&(t[i]), t[i].fn), PRIu64)
-#define put_cycles_s(fn)                                        \
-  _putfield(#fn"(s)", cycles_to_sec_f(&(t[i]), t[i].fn), ".3f")
-#define put_percent(a, b)                                               \
-  _putfield(#a"(%)", (t[i].b ? (t[i].a * 1e2 / t[i].b) : 0.0), ".3f")
+  g.n_bins = 0;
+  if( strcmp(arg, "log") == 0 ) {
+    for( decade = 100; decade <= 100000000; decade *= 10 )
+      for( v = 0; v < 3 && decade * steps[v] <= 100000000; ++v )
+        g.bin_ns[g.n_bins++] = decade * steps[v];
+    return true;
+  }
+  while( (t = strtok_r(csr, ",", &saveptr)) != NULL ) {
+    csr = NULL;
+    if( sscanf(t, "%u%c", &v, &dummy) != 1 || v == 0 || g.n_bins == MAX_BINS ||
+        (g.n_bins && v <= g.bin_ns[g.n_bins - 1]) )
+      return false;
+    g.bin_ns[g.n_bins++] = v;
+  }
+  return g.n_bins > 0;
+}
 
 
-static void write_summary(struct thread* t, FILE* f)
+/* Parses "walk:SIZE", where SIZE may have a k, m or g suffix. */
+static bool parse_walk(const char* arg, size_t* bytes)
 {
-  int i;
+  unsigned long long n;
+  char suffix = '\0', dummy;
+  int rc = sscanf(arg, "walk:%llu%c%c", &n, &suffix, &dummy);
 
-  for( i = 0; i < g.n_threads; ++i )
-    thread_calc_stats(&(t[i]));
-
-  putu(core_i);
-  _putfield("threshold(ns)", g.threshold_nsec, "u");
-  putu(cpu_mhz);
-  put_cycles(runtime);
-  put_cycles_s(runtime);
-  putu(int_n);
-  _putfield("int_n_per_sec",
-            t[i].int_n / cycles_to_sec_f(&(t[i]), t[i].runtime), ".3f");
-  put_cycles(int_min);
-  put_cycles(int_median);
-  put_cycles(int_mean);
-  put_cycles(int_90);
-  put_cycles(int_99);
-  put_cycles(int_999);
-  put_cycles(int_9999);
-  put_cycles(int_99999);
-  put_cycles(int_max);
-  put_cycles(int_total);
-  put_percent(int_total, runtime);
-  if( g.verbose ) {
-    put_frc(frc_start);
-    put_frc(frc_stop);
+  if( rc < 1 || rc > 2 )
+    return false;
+  switch( suffix ) {
+  case 'g':  case 'G':  n <<= 10;  /* fall through */
+  case 'm':  case 'M':  n <<= 10;  /* fall through */
+  case 'k':  case 'K':  n <<= 10;  /* fall through */
+  case '\0':
+    break;
+  default:
+    return false;
   }
+  /* Whole chunks only. */
+  *bytes = (n + WALK_CHUNK - 1) & ~((unsigned long long) WALK_CHUNK - 1);
+  return *bytes > 0;
 }
 
 
-static void run_expt(struct thread* threads, int runtime_secs)
+/* Checks for things that will get in the way of the real-time threads,
+ * and puts the main thread (and the helpers it starts) at a lower
+ * priority than them.
+ */
+static void rt_setup(struct thread* threads)
 {
+  long runtime_us = -1, period_us = 0;
+  struct sched_param sp;
+  FILE* f;
   int i;
 
-  g.runtime_secs = runtime_secs;
-  g.n_threads_started = 0;
-  g.n_threads_ready = 0;
-  g.n_threads_running = 0;
-  g.n_threads_finished = 0;
-  g.cmd = WAIT;
+  if( (f = fopen("/proc/sys/kernel/sched_rt_runtime_us", "r")) != NULL ) {
+    if( fscanf(f, "%ld", &runtime_us) != 1 )
+      runtime_us = -1;
+    fclose(f);
+  }
+  if( (f = fopen("/proc/sys/kernel/sched_rt_period_us", "r")) != NULL ) {
+    if( fscanf(f, "%ld", &period_us) != 1 )
+      period_us = 0;
+    fclose(f);
+  }
+  if( runtime_us >= 0 && period_us > 0 && runtime_us < period_us )
+    fprintf(stderr, "%s: WARNING: RT throttling will stop the measuring "
+            "threads for %ldus in every %ldus (see "
+            "/proc/sys/kernel/sched_rt_runtime_us)\n", APP_NAME,
+            period_us - runtime_us, period_us);
 
+  /* RT throttling stops every RT thread on the core, so if we share a core
+   * with a measuring thread we have to stay out of the RT class to run.
+   */
   for( i = 0; i < g.n_threads; ++i )
-    TEST0(pthread_create(&(threads[i].thread_id), NULL,
-                         thread_main, &(threads[i])));
-  while( g.n_threads_started != g.n_threads )
-    usleep(1000);
-  gettimeofday(&g.tv_start, NULL);
-  g.cmd = GO;
-
-  alarm(g.runtime_secs);
+    if( threads[i].core_i == g.housekeeping_core ) {
+      fprintf(stderr, "%s: WARNING: housekeeping core %d is also measured, so "
+              "the main thread only runs when the measuring thread is "
+              "throttled (see --housekeeping)\n", APP_NAME,
+              g.housekeeping_core);
+      return;
+    }
 
-  /* Go to sleep until the threads have done their stuff. */
-  for( i = 0; i < g.n_threads; ++i )
-    pthread_join(threads[i].thread_id, NULL);
-  post_test_checks(threads);
+  if( g.rt_policy != SCHED_DEADLINE && g.rt_prio > 1 ) {
+    sp.sched_priority = g.rt_prio - 1;
+    if( (errno = pthread_setschedparam(pthread_self(), g.rt_policy,
+                                       &sp)) != 0 )
+      fprintf(stderr, "%s: WARNING: Could not set main thread priority (%s)\n",
+              APP_NAME, strerror(errno));
+  }
 }
 
 
-static void cleanup_expt(struct thread* threads)
+/* Adds the cpus in a cpulist file (such as "0-3,8") to [set].  Missing
+ * and empty files (and nohz_full's "(null)") add nothing.
+ */
+static bool read_cpulist(const char* path, cpu_set_t* set)
 {
-  int i;
-  for( i = 0; i < g.n_threads; ++i ) {
-    free(threads[i].interruptions);
-    threads[i].interruptions = NULL;
-    free(threads[i].sorted);
-    threads[i].sorted = NULL;
+  char line[4096];
+  unsigned low, high;
+  char *saveptr = NULL, *t, *csr = line;
+  FILE* f;
+  bool ok;
+
+  if( (f = fopen(path, "r")) == NULL )
+    return false;
+  ok = fgets(line, sizeof(line), f) != NULL;
+  fclose(f);
+  if( ! ok )
+    return true;
+  while( (t = strtok_r(csr, ",\n", &saveptr)) != NULL ) {
+    csr = NULL;
+    if( sscanf(t, "%u-%u", &low, &high) == 2 )
+      for( ; low <= high && low < CPU_SETSIZE; ++low )
+        CPU_SET(low, set);
+    else if( sscanf(t, "%u", &low) == 1 && low < CPU_SETSIZE )
+      CPU_SET(low, set);
   }
+  return true;
 }
 
 
-static void calc_max_interruptions(struct thread* threads, int runtime)
+/* Parses the --cores arg into [set].  Entries are core numbers, ranges,
+ * "isolated" (isolcpus and nohz_full) and "node:N".
+ */
+static bool parse_cores(const char* csr_in, cpu_set_t* set)
 {
-  /* Calculate how big max_interruptions needs to be for real run of
-   * [runtime] seconds.
-   */
-  struct thread* t;
-  int i, max = 0, per_sec;
+  char* csr = strdupa(csr_in);
+  char *saveptr = NULL, *t;
+  char path[64];
+  unsigned low, high;
+  char dummy;
 
-  for( i = 0; i < g.n_threads; ++i ) {
-    t = &(threads[i]);
-    t->int_n = t->c_interruption - t->interruptions;
-    if( t->int_n > max )
-      max = t->int_n;
+  CPU_ZERO(set);
+  while( (t = strtok_r(csr, ",", &saveptr)) != NULL ) {
+    csr = NULL;
+    if( strcmp(t, "isolated") == 0 ) {
+      read_cpulist("/sys/devices/system/cpu/isolated", set);
+      read_cpulist("/sys/devices/system/cpu/nohz_full", set);
+    }
+    else if( sscanf(t, "node:%u%c", &low, &dummy) == 1 ) {
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+               low);
+      if( ! read_cpulist(path, set) ) {
+        fprintf(stderr, "%s: ERROR: No such NUMA node %u\n", APP_NAME, low);
+        exit(2);
+      }
+    }
+    else if( sscanf(t, "%u - %u%c", &low, &high, &dummy) == 2 ) {
+      for( ; low <= high && low < CPU_SETSIZE; ++low )
+        CPU_SET(low, set);
+    }
+    else if( sscanf(t, "%u%c", &low, &dummy) == 1 && low < CPU_SETSIZE ) {
+      CPU_SET(low, set);
+    }
+    else {
+      return false;
+    }
   }
+  return true;
+}
 
-  /* If getting a low number of interruptions per second then variance may be
-   * quite high.  So
-   */
-  per_sec = max / g.runtime_secs;
-  if( per_sec < 1000 )
-    per_sec = 1000;
-  g.max_interruptions = per_sec * 2 * runtime;
+
+/* Removes all but the first of each set of SMT siblings from [set], along
+ * with any core whose sibling was already chosen.
+ */
+static void drop_smt_siblings(cpu_set_t* set)
+{
+  cpu_set_t siblings;
+  char path[80];
+  int cpu, sib;
+
+  for( cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+    if( ! CPU_ISSET(cpu, set) )
+      continue;
+    CPU_ZERO(&siblings);
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    read_cpulist(path, &siblings);
+    for( sib = cpu + 1; sib < CPU_SETSIZE; ++sib )
+      if( CPU_ISSET(sib, &siblings) )
+        CPU_CLR(sib, set);
+  }
 }
 
 
-static void handle_alarm(int code)
+/* The first core in [allowed] that is not in [measured] or loaded, or
+ * failing that the first in [allowed].
+ */
+static int pick_housekeeping_core(const cpu_set_t* allowed,
+                                  const cpu_set_t* measured)
 {
-  g.cmd = STOP;
+  int i, first = -1;
+  unsigned k;
+
+  for( i = 0; i < CPU_SETSIZE; ++i ) {
+    if( ! CPU_ISSET(i, allowed) )
+      continue;
+    if( first < 0 )
+      first = i;
+    if( CPU_ISSET(i, measured) )
+      continue;
+    for( k = 0; k < g.n_loads; ++k )
+      if( CPU_ISSET(i, &g.loads[k].cores) )
+        break;
+    if( k == g.n_loads )
+      return i;
+  }
+  return first < 0 ? 0 : first;
 }
 
 
-static void append_int(int** list, int* list_len, int val)
+/* Parses "CORES:KIND" for --load. */
+static bool parse_load(const char* arg, struct load_spec* l)
 {
-  int idx = (*list_len)++;
-  TEST( *list = realloc(*list, *list_len * sizeof(int)) );
-  (*list)[idx] = val;
+  const char* kind = strrchr(arg, ':');
+  char cores[kind ? kind - arg + 1 : 1];
+  unsigned k;
+
+  if( kind == NULL )
+    return false;
+  memcpy(cores, arg, kind - arg);
+  cores[kind - arg] = '\0';
+  for( k = 0; k < sizeof(load_kind_names) / sizeof(load_kind_names[0]); ++k )
+    if( strcmp(kind + 1, load_kind_names[k]) == 0 )
+      break;
+  if( k == sizeof(load_kind_names) / sizeof(load_kind_names[0]) ||
+      ! parse_cores(cores, &l->cores) )
+    return false;
+  l->arg = arg;
+  l->kind = k;
+  return true;
 }
 
 
-static bool parse_comma_sep_ranges(const char* csr_in,
-                                   int** list, int* list_len)
+#ifdef SYSJITTER_MPI
+struct node_summary {
+  char                 host[64];
+  unsigned             n_cores;
+  uint64_t             int_n;
+  /* Worst over the node's cores. */
+  uint64_t             int_99_ns;
+  uint64_t             int_9999_ns;
+  uint64_t             int_max_ns;
+  double               int_total_pc;
+};
+
+
+#define put_nodes(label, val, fmt) do {         \
+  printf("%s:", label);                         \
+  for( r = 0; r < g.mpi_size; ++r )             \
+    printf(" %"fmt, val);                       \
+  printf("\n");                                 \
+} while( 0 )
+
+#define max_in(a, b)  do { if( (b) > (a) )  (a) = (b); } while( 0 )
+
+
+/* Gathers every node's results on rank 0, which reports a column per
+ * node, the distribution over all cores in the job, and the worst
+ * interruption on any node in each --interval window.  A bulk-synchronous
+ * job that synchronises once per window loses about window_max_total.
+ */
+static void write_job_report(struct thread* threads)
 {
-  char* csr = strdupa(csr_in);
-  char *saveptr = NULL, *t;
-  unsigned low, high;
-  char dummy;
+  struct node_summary me, *nodes = NULL;
+  struct sj_histogram *h, *job = NULL;
+  uint64_t win[g.n_windows], job_n = 0, job_max = 0, sum;
+  unsigned b, n_windows, n_cores = 0;
+  struct thread* t;
+  int i, r;
 
-  *list = NULL;
-  *list_len = 0;
+  memset(&me, 0, sizeof(me));
+  gethostname(me.host, sizeof(me.host) - 1);
+  me.n_cores = g.n_threads;
+  /* Nodes may tick at different rates, so merge in nanoseconds. */
+  TEST(h = calloc(1, sizeof(*h)));
+  for( i = 0; i < g.n_threads; ++i ) {
+    t = &(threads[i]);
+    me.int_n += t->int_n;
+    max_in(me.int_99_ns, t->stats.int_99);
+    max_in(me.int_9999_ns, t->stats.int_9999);
+    max_in(me.int_max_ns, t->stats.int_max);
+    max_in(me.int_total_pc, t->stats.int_total_pc);
+    for( b = 0; b < SJ_HIST_N_BUCKETS; ++b )
+      if( t->hist->counts[b] )
+        h->counts[sj_hist_bucket(cycles_to_ns(t, sj_hist_bucket_max(b)))] +=
+          t->hist->counts[b];
+  }
+  if( g.mpi_rank == 0 ) {
+    TEST(nodes = malloc(g.mpi_size * sizeof(nodes[0])));
+    TEST(job = malloc(sizeof(*job)));
+  }
+  MPI_Gather(&me, sizeof(me), MPI_BYTE, nodes, sizeof(me), MPI_BYTE,
+             0, MPI_COMM_WORLD);
+  MPI_Reduce(h->counts, job ? job->counts : NULL, SJ_HIST_N_BUCKETS,
+             MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(g.window_max_ns, win, g.n_windows, MPI_UINT64_T, MPI_MAX,
+             0, MPI_COMM_WORLD);
+  MPI_Reduce(&g.n_windows_done, &n_windows, 1, MPI_UNSIGNED, MPI_MIN,
+             0, MPI_COMM_WORLD);
+  free(h);
+  if( g.mpi_rank != 0 )
+    return;
 
-  while( (t = strtok_r(csr, ",", &saveptr)) != NULL ) {
-    csr = NULL;
-    if( sscanf(t, "%u - %u%c", &low, &high, &dummy) == 2 )
-      for( ; low <= high; ++low )
-        append_int(list, list_len, low);
-    else if( sscanf(t, "%u%c", &low, &dummy) == 1 )
-      append_int(list, list_len, low);
-    else
-      return false;
+  for( r = 0; r < g.mpi_size; ++r ) {
+    n_cores += nodes[r].n_cores;
+    job_n += nodes[r].int_n;
+    max_in(job_max, nodes[r].int_max_ns);
   }
-  return true;
+  printf("# job: %d nodes, %u cores\n", g.mpi_size, n_cores);
+  put_nodes("node", nodes[r].host, "s");
+  put_nodes("node_cores", nodes[r].n_cores, "u");
+  put_nodes("node_int_n", nodes[r].int_n, PRIu64);
+  put_nodes("node_int_99(ns)", nodes[r].int_99_ns, PRIu64);
+  put_nodes("node_int_9999(ns)", nodes[r].int_9999_ns, PRIu64);
+  put_nodes("node_int_max(ns)", nodes[r].int_max_ns, PRIu64);
+  put_nodes("node_int_total(%)", nodes[r].int_total_pc, ".3f");
+  printf("job_int_n: %"PRIu64"\n", job_n);
+  printf("job_int_median(ns): %"PRIu64"\n",
+         sj_hist_value_at_rank(job, job_n / 2, 0, job_max));
+  printf("job_int_99(ns): %"PRIu64"\n",
+         sj_hist_value_at_rank(job, job_n * 0.99, 0, job_max));
+  printf("job_int_9999(ns): %"PRIu64"\n",
+         sj_hist_value_at_rank(job, job_n * 0.9999, 0, job_max));
+  printf("job_int_max(ns): %"PRIu64"\n", job_max);
+  if( n_windows ) {
+    printf("window(s): %.3f\n", g.interval_secs);
+    printf("window_max(ns):");
+    for( sum = 0, b = 0; b < n_windows; ++b ) {
+      printf(" %"PRIu64, win[b]);
+      sum += win[b];
+    }
+    printf("\nwindow_max_total(ns): %"PRIu64"\n", sum);
+  }
+  free(job);
+  free(nodes);
 }
+#endif
 
 
 int main(int argc, char* argv[])
 {
   struct thread* threads;
-  const char* raw_prefix = NULL;
   const char* cores_opt = NULL;
+  const char* interval_file = NULL;
+  const char* val;
   char dummy;
-  int n_cores, runtime = 70;
-  int* cores;
+  int i, rc, n_cores, runtime = 70, no_calibration_run = 0, no_smt_siblings = 0;
+  int rt_policy = -1, housekeeping_default = 0;
+  unsigned k;
 
   g.max_interruptions = 1000000;
+  g.ring_size = 65536;
+  g.perf_pages = 256;
+  g.wakeup_period_usec = 1000;
+  g.n_trials = 1;
+  g.clock = CLOCK_NATIVE;
+  g.housekeeping_core = -1;
+
+#ifdef SYSJITTER_MPI
+  /* We have threads of our own, but only the main thread calls MPI. */
+  {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    if( provided < MPI_THREAD_FUNNELED ) {
+      fprintf(stderr, "%s: ERROR: MPI does not support MPI_THREAD_FUNNELED\n",
+              APP_NAME);
+      MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+  }
+  MPI_Comm_rank(MPI_COMM_WORLD, &g.mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &g.mpi_size);
+  /* Rank 0 speaks for the job. */
+  if( g.mpi_rank != 0 )
+    TEST(freopen("/dev/null", "w", stdout) != NULL);
+#endif
 
   --argc; ++argv;
   for( ; argc; --argc, ++argv ) {
     if( argv[0][0] != '-' ) {
       break;
     }
-    else if( strcmp(argv[0], "--max") == 0 && argc > 1 &&
-             sscanf(argv[1], "%u%c", &g.max_interruptions, &dummy) == 1 ) {
-      --argc, ++argv;
+    else if( (val = opt_val("--max", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &g.max_interruptions, &dummy) != 1 )
+        usage_err();
+    }
+    else if( (val = opt_val("--raw", &argc, &argv)) != NULL ) {
+      g.raw_prefix = val;
+    }
+    else if( (val = opt_val("--raw-format", &argc, &argv)) != NULL ) {
+      if( strcmp(val, "bin") == 0 )
+        g.raw_bin = 1;
+      else if( strcmp(val, "text") == 0 )
+        g.raw_bin = 0;
+      else
+        usage_err();
+    }
+    else if( (val = opt_val("--mem", &argc, &argv)) != NULL ) {
+      if( strcmp(val, "default") == 0 )
+        g.mem = MEM_DEFAULT;
+      else if( strcmp(val, "thp") == 0 )
+        g.mem = MEM_THP;
+      else if( strcmp(val, "hugetlb") == 0 )
+        g.mem = MEM_HUGETLB;
+      else
+        usage_err();
+    }
+    else if( strcmp(argv[0], "--mlock") == 0 ) {
+      g.mlock = 1;
+    }
+    else if( (val = opt_val("--interval", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%lf%c", &g.interval_secs, &dummy) != 1 ||
+          g.interval_secs <= 0 )
+        usage_err();
+    }
+    else if( strcmp(argv[0], "--attribute") == 0 ) {
+      g.attribute = 1;
+    }
+    else if( strcmp(argv[0], "--perf-causes") == 0 ) {
+      g.perf = 1;
+    }
+    else if( (val = opt_val("--coincidence", &argc, &argv)) != NULL ) {
+      g.coincide_window_nsec = COINCIDE_WINDOW_NS;
+      if( sscanf(val, "%u%c", &g.coincide_k, &dummy) != 1 &&
+          (sscanf(val, "%u:%u%c", &g.coincide_k,
+                  &g.coincide_window_nsec, &dummy) != 2 ||
+           g.coincide_window_nsec == 0) )
+        usage_err();
+      if( g.coincide_k < 2 )
+        usage_err();
+    }
+    else if( (val = opt_val("--loop", &argc, &argv)) != NULL ) {
+      g.loop = NULL;
+      for( k = 0; k < N_LOOP_VARIANTS; ++k )
+        if( strcmp(val, loop_variants[k].name) == 0 )
+          g.loop = &(loop_variants[k]);
+      if( g.loop == NULL )
+        usage_err();
+    }
+    else if( (val = opt_val("--clock", &argc, &argv)) != NULL ) {
+      for( k = 1; k < SJ_N_CLOCKS; ++k )
+        if( strcmp(val, clock_names[k]) == 0 )
+          break;
+      if( k == SJ_N_CLOCKS )
+        usage_err();
+      if( (k != CLOCK_NATIVE && clock_loops[k].name == NULL) ||
+          (k == SJ_CLOCK_RDTSCP && ! sj_has_rdtscp()) ) {
+        fprintf(stderr, "%s: ERROR: --clock %s is not available here\n",
+                APP_NAME, val);
+        exit(1);
+      }
+      g.clock = k;
+    }
+    else if( (val = opt_val("--mode", &argc, &argv)) != NULL ) {
+      if( strcmp(val, "busy") == 0 )
+        g.wakeup = 0;
+      else if( strcmp(val, "wakeup") == 0 )
+        g.wakeup = 1;
+      else
+        usage_err();
+    }
+    else if( (val = opt_val("--wakeup-period", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &g.wakeup_period_usec, &dummy) != 1 ||
+          g.wakeup_period_usec == 0 )
+        usage_err();
+    }
+    else if( (val = opt_val("--workload", &argc, &argv)) != NULL ) {
+      if( ! parse_walk(val, &g.walk_bytes) )
+        usage_err();
+    }
+    else if( (val = opt_val("--load", &argc, &argv)) != NULL ) {
+      if( g.n_loads == MAX_LOADS || ! parse_load(val, &g.loads[g.n_loads]) )
+        usage_err();
+      ++g.n_loads;
+    }
+    else if( (val = opt_val("--bins", &argc, &argv)) != NULL ) {
+      if( ! parse_bins(val) )
+        usage_err();
+    }
+    else if( strcmp(argv[0], "--msr") == 0 ) {
+#if defined(__x86_64__) || defined(__i386__)
+      g.msr = 1;
+#else
+      fprintf(stderr, "%s: ERROR: --msr is only supported on x86\n", APP_NAME);
+      exit(1);
+#endif
+    }
+    else if( (val = opt_val("--perf-pages", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &g.perf_pages, &dummy) != 1 ||
+          g.perf_pages == 0 )
+        usage_err();
+      if( g.perf_pages & (g.perf_pages - 1) ) {
+        fprintf(stderr, "%s: ERROR: --perf-pages must be a power of 2\n",
+                APP_NAME);
+        exit(1);
+      }
+    }
+    else if( (val = opt_val("--interval-file", &argc, &argv)) != NULL ) {
+      interval_file = val;
+    }
+    else if( strcmp(argv[0], "--no-smt-siblings") == 0 ) {
+      no_smt_siblings = 1;
+    }
+    else if( (val = opt_val("--cores", &argc, &argv)) != NULL ) {
+      cores_opt = val;
+    }
+    else if( strcmp(argv[0], "--periodicity") == 0 ) {
+      g.periodicity = 1;
+    }
+    else if( (val = opt_val("--trigger", &argc, &argv)) != NULL ) {
+      char stop[8];
+      int n = sscanf(val, "%u%c%7s%c", &g.trigger_nsec, &dummy, stop,
+                     &dummy);
+      if( g.trigger_nsec == 0 ||
+          ! (n == 1 || (n == 3 && dummy == ':' && strcmp(stop, "stop") == 0)) )
+        usage_err();
+      g.trigger_stop = n == 3;
+    }
+    else if( strcmp(argv[0], "--daemon") == 0 ) {
+      g.daemon = 1;
+    }
+    else if( (val = opt_val("--save-baseline", &argc, &argv)) != NULL ) {
+      g.baseline_save = val;
     }
-    else if( strcmp(argv[0], "--raw") == 0 && argc > 1 ) {
-      raw_prefix = argv[1];
-      --argc, ++argv;
+    else if( (val = opt_val("--compare", &argc, &argv)) != NULL ) {
+      g.baseline_compare = val;
     }
-    else if( strcmp(argv[0], "--cores") == 0 && argc > 1 ) {
-      cores_opt = argv[1];
-      --argc, ++argv;
+    else if( (val = opt_val("--max-regress", &argc, &argv)) != NULL ) {
+      if( ! parse_regress(val) ) {
+        fprintf(stderr, "%s: ERROR: Bad --max-regress '%s'\n",
+                APP_NAME, val);
+        usage_err();
+      }
     }
-    else if( strcmp(argv[0], "--runtime") == 0 && argc > 1 &&
-             sscanf(argv[1], "%u%c", &runtime, &dummy) == 1 ) {
-      --argc, ++argv;
+    else if( (val = opt_val("--trials", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &g.n_trials, &dummy) != 1 ||
+          g.n_trials == 0 )
+        usage_err();
+    }
+    else if( (val = opt_val("--gap", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%lf%c", &g.trial_gap_secs, &dummy) != 1 ||
+          g.trial_gap_secs < 0 )
+        usage_err();
+    }
+    else if( (val = opt_val("--runtime", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &runtime, &dummy) != 1 )
+        usage_err();
     }
     else if( strcmp(argv[0], "--sort") == 0 ) {
       g.sort_raw = 1;
     }
+    else if( strcmp(argv[0], "--stream") == 0 ) {
+      g.stream = 1;
+    }
+    else if( strcmp(argv[0], "--calibrate") == 0 ) {
+      g.calibrate = 1;
+    }
+    else if( strcmp(argv[0], "--no-calibration-run") == 0 ) {
+      no_calibration_run = 1;
+    }
+    else if( (val = opt_val("--ring-size", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%u%c", &g.ring_size, &dummy) != 1 ||
+          g.ring_size == 0 )
+        usage_err();
+      if( g.ring_size & (g.ring_size - 1) ) {
+        fprintf(stderr, "%s: ERROR: --ring-size must be a power of 2\n",
+                APP_NAME);
+        exit(1);
+      }
+    }
+    else if( (val = opt_val("--rt-prio", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%d%c", &g.rt_prio, &dummy) != 1 ||
+          g.rt_prio < 1 || g.rt_prio > 99 )
+        usage_err();
+    }
+    else if( (val = opt_val("--rt-policy", &argc, &argv)) != NULL ) {
+      if( strcmp(val, "fifo") == 0 )
+        rt_policy = SCHED_FIFO;
+      else if( strcmp(val, "rr") == 0 )
+        rt_policy = SCHED_RR;
+      else if( strcmp(val, "deadline") == 0 )
+        rt_policy = SCHED_DEADLINE;
+      else
+        usage_err();
+    }
+    else if( (val = opt_val("--housekeeping", &argc, &argv)) != NULL ) {
+      if( sscanf(val, "%d%c", &g.housekeeping_core, &dummy) != 1 ||
+          g.housekeeping_core < 0 )
+        usage_err();
+    }
     else if( strcmp(argv[0], "--verbose") == 0 ) {
       g.verbose = 1;
     }
@@ -699,58 +4660,328 @@ int main(int argc, char* argv[])
     }
   }
 
+  if( g.clock != CLOCK_NATIVE ) {
+    if( g.loop != NULL || g.wakeup || g.walk_bytes ) {
+      fprintf(stderr, "%s: ERROR: --clock %s is only supported in the busy "
+              "loop, without --loop\n", APP_NAME, clock_names[g.clock]);
+      exit(1);
+    }
+    g.loop = &(clock_loops[g.clock]);
+  }
+  if( g.n_bins && g.loop != NULL && g.loop->stored_bins == NULL ) {
+    fprintf(stderr, "%s: ERROR: --bins is not supported with --loop %s\n",
+            APP_NAME, g.loop->name);
+    exit(1);
+  }
+  /* Without --loop, --bins gets the plain register loop. */
+  if( g.loop == NULL )
+    g.loop = &(loop_variants[g.n_bins ? 1 : 0]);
+  if( g.wakeup && g.walk_bytes ) {
+    fprintf(stderr, "%s: ERROR: --workload cannot be used with --mode wakeup\n",
+            APP_NAME);
+    exit(1);
+  }
+  if( g.trigger_nsec && (g.wakeup || g.walk_bytes) ) {
+    fprintf(stderr, "%s: ERROR: --trigger is only supported in the busy "
+            "loop\n", APP_NAME);
+    exit(1);
+  }
+  if( g.n_bins && (g.wakeup || g.walk_bytes) ) {
+    fprintf(stderr, "%s: ERROR: --bins is only supported in the busy loop\n",
+            APP_NAME);
+    exit(1);
+  }
+  if( (g.baseline_compare != NULL) != (g.n_regress > 0) ) {
+    fprintf(stderr, "%s: ERROR: --compare and --max-regress go together\n",
+            APP_NAME);
+    exit(1);
+  }
+  if( (g.baseline_save || g.baseline_compare) && g.n_trials > 1 ) {
+    fprintf(stderr, "%s: ERROR: Baselines are not supported with --trials\n",
+            APP_NAME);
+    exit(1);
+  }
+  g.rt_policy = SCHED_OTHER;
+  if( rt_policy == SCHED_DEADLINE )
+    g.rt_policy = SCHED_DEADLINE;
+  else if( g.rt_prio )
+    g.rt_policy = rt_policy >= 0 ? rt_policy : SCHED_FIFO;
+  else if( rt_policy >= 0 ) {
+    fprintf(stderr, "%s: ERROR: --rt-policy %s needs --rt-prio\n",
+            APP_NAME, policy_name(rt_policy));
+    exit(1);
+  }
+
   if( argc != 1  ||
       sscanf(argv[0], "%u%c", &g.threshold_nsec, &dummy) != 1 )
     usage_err();
 
-  int nprocs = get_nprocs_conf();
-  cpu_set_t cpus;
-  sched_getaffinity(getpid(), sizeof cpus, &cpus);
+  if( g.trigger_nsec && g.trigger_nsec < g.threshold_nsec ) {
+    fprintf(stderr, "%s: ERROR: --trigger must not be below the threshold\n",
+            APP_NAME);
+    exit(1);
+  }
 
-  if( cores_opt == NULL ) {
-    n_cores = CPU_COUNT(&cpus);
+  if( g.stream && g.sort_raw ) {
+    fprintf(stderr, "%s: ERROR: --sort cannot be used with --stream\n",
+            APP_NAME);
+    exit(1);
   }
-  else {
-    if( ! parse_comma_sep_ranges(cores_opt, &cores, &n_cores) ) {
+  if( g.stream && g.raw_prefix != NULL &&
+      (g.perf || g.coincide_k || g.periodicity) ) {
+    fprintf(stderr, "%s: ERROR: --%s cannot be used with --stream\n",
+            APP_NAME, g.perf ? "perf-causes" :
+            g.coincide_k ? "coincidence" : "periodicity");
+    exit(1);
+  }
+  /* Interruptions are only kept when raw output, causes, coincidences or
+   * periods are wanted, and streaming only makes a difference to how they are
+   * kept.  Without a calibration run to size the buffers, the collector
+   * gathers them instead.
+   */
+  int want_raw = g.raw_prefix != NULL || g.perf || g.coincide_k ||
+    g.periodicity;
+  if( g.daemon && (want_raw || g.n_trials > 1 || g.n_loads ||
+                   g.baseline_compare || g.baseline_save) ) {
+    fprintf(stderr, "%s: ERROR: --daemon keeps no raw data, and does not "
+            "combine with --trials, --load or baselines\n", APP_NAME);
+    exit(1);
+  }
+#ifdef SYSJITTER_MPI
+  if( g.daemon ) {
+    fprintf(stderr, "%s: ERROR: --daemon is not supported with MPI\n",
+            APP_NAME);
+    exit(1);
+  }
+#endif
+  if( g.raw_prefix == NULL )
+    g.stream = 0;
+  if( want_raw && no_calibration_run && ! g.stream )
+    g.stream = g.gather = 1;
+  g.store_raw = want_raw && ! g.stream;
+  g.keep_raw = g.store_raw || g.gather;
+  g.page_size = sysconf(_SC_PAGESIZE);
+  if( g.perf )
+    perf_find_tracepoints();
+
+  /* Measure on the requested cores that we're allowed to run on. */
+  cpu_set_t cpus, want, allowed;
+  sched_getaffinity(getpid(), sizeof cpus, &cpus);
+  allowed = cpus;
+  if( cores_opt != NULL ) {
+    if( ! parse_cores(cores_opt, &want) ) {
       fprintf(stderr, "%s: ERROR: badly formatted --cores arg\n", APP_NAME);
       exit(2);
     }
+    for( i = 0; i < CPU_SETSIZE; ++i )
+      if( CPU_ISSET(i, &want) && ! CPU_ISSET(i, &cpus) )
+        fprintf(stderr, "%s: WARNING: core %d is not in the affinity mask\n",
+                APP_NAME, i);
+    CPU_AND(&cpus, &cpus, &want);
+  }
+  if( no_smt_siblings )
+    drop_smt_siblings(&cpus);
+  /* Load cores are not measured. */
+  for( k = 0; k < g.n_loads; ++k )
+    for( i = 0; i < CPU_SETSIZE; ++i )
+      if( CPU_ISSET(i, &g.loads[k].cores) ) {
+        CPU_CLR(i, &cpus);
+        TEST(g.load_threads = realloc(g.load_threads, (g.n_load_threads + 1) *
+                                      sizeof(g.load_threads[0])));
+        g.load_threads[g.n_load_threads].core_i = i;
+        g.load_threads[g.n_load_threads++].kind = g.loads[k].kind;
+      }
+  if( (n_cores = CPU_COUNT(&cpus)) == 0 ) {
+    fprintf(stderr, "%s: ERROR: no cores to measure\n", APP_NAME);
+    exit(2);
   }
 
-  /* Check which cores we can use by trying to set affinity to each. */
-  TEST( threads = malloc(n_cores * sizeof(threads[0])) );
+  TEST0(posix_memalign((void**) &threads, THREAD_ALIGN,
+                       n_cores * sizeof(threads[0])));
+  memset(threads, 0, n_cores * sizeof(threads[0]));
+  g.threads = threads;
+  TEST(n_cores <= 1 << BARRIER_MAX_ROUNDS);
   g.n_threads = n_cores;
+  for( i = 0, k = 0; i < CPU_SETSIZE; ++i )
+    if( CPU_ISSET(i, &cpus) )
+      threads[k++].core_i = i;
 
-  /* FIXME This ignores any input to --cores from the user */
-  int cur_proc = 0;
-  for (int i = 0; i != n_cores; ++i, ++cur_proc)
-  {
-    while (!CPU_ISSET(cur_proc, &cpus) && cur_proc != nprocs)
-        ++cur_proc;
-
-    if (cur_proc != nprocs)
-      threads[i].core_i = cur_proc;
-    else
-    {
-      puts("error: reached nprocs limit");
-      exit(1);
+  /* Put the main thread (and any helper threads) on the housekeeping core,
+   * by default the first core we may use that isn't measured or loaded.
+   */
+  if( g.housekeeping_core < 0 ) {
+    housekeeping_default = 1;
+    g.housekeeping_core = pick_housekeeping_core(&allowed, &cpus);
+  }
+  if( move_to_core(g.housekeeping_core) != 0 ) {
+    if( ! housekeeping_default ) {
+      fprintf(stderr, "%s: ERROR: Could not move to housekeeping core %d "
+              "(%s)\n", APP_NAME, g.housekeeping_core, strerror(errno));
+      exit(2);
     }
+    fprintf(stderr, "%s: WARNING: Could not move to housekeeping core %d "
+            "(%s); using core %d\n", APP_NAME, g.housekeeping_core,
+            strerror(errno), sched_getcpu());
+    g.housekeeping_core = sched_getcpu();
+    move_to_core(g.housekeeping_core);
   }
-
-  move_to_core(0);  // put the main thread on core 0
   signal(SIGALRM, handle_alarm);
+  /* A daemon runs until told to stop, then reports as usual. */
+  if( g.daemon ) {
+    runtime = 0;
+    signal(SIGTERM, handle_alarm);
+    signal(SIGINT, handle_alarm);
+    if( g.interval_secs == 0 ) {
+      g.interval_secs = 1;
+      g.interval_quiet = 1;
+    }
+  }
+  if( g.rt_policy != SCHED_OTHER )
+    rt_setup(threads);
+
+#ifdef SYSJITTER_MPI
+  /* The job report needs the interval windows, even if not asked for. */
+  if( g.interval_secs == 0 ) {
+    g.interval_secs = 1;
+    g.interval_quiet = 1;
+  }
+  g.n_windows = runtime / g.interval_secs + 1;
+  TEST(g.window_max_ns = calloc(g.n_windows, sizeof(g.window_max_ns[0])));
+#endif
+  /* Our own helper threads interrupt whatever else runs on their core. */
+  if( CPU_ISSET(g.housekeeping_core, &cpus) &&
+      (g.stream || g.gather || g.interval_secs || g.trigger_nsec) )
+    fprintf(stderr, "%s: WARNING: Housekeeping core %d is also measured, and "
+            "sysjitter's own %s thread will interrupt it; use --housekeeping "
+            "and --cores to keep them apart\n", APP_NAME, g.housekeeping_core,
+            g.trigger_nsec ? "trigger" :
+            g.interval_secs ? "reporter" : "collector");
+  g.interval_f = stdout;
+  if( interval_file != NULL &&
+      (g.interval_f = fopen(interval_file, "a")) == NULL ) {
+    fprintf(stderr, "%s: ERROR: Could not open '%s' for appending (%s)\n",
+            APP_NAME, interval_file, strerror(errno));
+    exit(3);
+  }
+  /* Interval reports wait on a monotonic deadline. */
+  {
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&g.reporter_cond, &ca);
+    pthread_condattr_destroy(&ca);
+  }
+
+  g.huge_page_size = read_huge_page_size();
+  if( g.mem != MEM_DEFAULT || g.rt_policy != SCHED_OTHER )
+    g.mlock = 1;
+  /* Lock everything now and in future (including the threads' stacks and
+   * buffers) so that we don't take page faults while measuring.
+   */
+  if( g.mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0 )
+    fprintf(stderr, "%s: WARNING: mlockall failed (%s)\n",
+            APP_NAME, strerror(errno));
+
+  if( g.clock == SJ_CLOCK_CLOCK_GETTIME )
+    g.cpu_mhz = 1000;  /* ticks are ns */
+  else if( ! g.calibrate )
+    g.cpu_mhz = sj_platform_cpu_mhz();
+  /* In a VM the vCPUs may be preempted by the host, which only shows up
+   * as steal time, and the counter may be scaled or emulated.
+   */
+  if( (g.hypervisor = sj_hypervisor()) != NULL ) {
+    printf("# hypervisor: %s\n", g.hypervisor);
+    g.show_steal = 1;
+  }
+  if( g.cpu_mhz && g.clock != SJ_CLOCK_CLOCK_GETTIME ) {
+    unsigned m = sj_measure_cpu_mhz();
+    if( m < g.cpu_mhz * 0.99 || m > g.cpu_mhz * 1.01 )
+      fprintf(stderr, "%s: WARNING: Counter ticks at %uMHz but the platform "
+              "says %uMHz; it may be virtualised or scaled\n",
+              APP_NAME, m, g.cpu_mhz);
+  }
+  if( g.verbose )
+    printf("# cpu_mhz from %s\n", g.cpu_mhz ? "platform" : "calibration");
 
-  run_expt(threads, 1);
-  calc_max_interruptions(threads, runtime);
-  cleanup_expt(threads);
-  run_expt(threads, runtime);
+  /* A TSC that stops or changes rate with the core's power state does not
+   * measure time.
+   */
+  if( (g.clock == SJ_CLOCK_RDTSC || g.clock == SJ_CLOCK_RDTSCP ||
+       g.clock == SJ_CLOCK_LFENCE_RDTSC) && sj_tsc_invariant() == 0 )
+    fprintf(stderr, "%s: WARNING: The TSC is not invariant, so gaps may not "
+            "be what they seem; try --clock clock_gettime\n", APP_NAME);
 
-  /* NB. Important to write raw results first, as write_summary() sorts the
-   * interruptions.
+  /* Takes a helper thread and many round trips per core, so only when
+   * something needs the offsets.
+   */
+  g.measure_offsets = g.coincide_k || g.verbose || g.clock != CLOCK_NATIVE;
+  if( g.measure_offsets )
+    measure_frc_offsets(threads);
+  for( i = 0; g.measure_offsets && i < g.n_threads; ++i )
+    if( llabs(threads[i].frc_offset) >
+        2 * threads[i].frc_offset_err + CLOCK_SKEW_SLACK )
+      fprintf(stderr, "%s: WARNING: Clock on core %d is %"PRId64" ticks "
+              "(+/-%"PRIu64") out from core %d; --coincidence and start skew "
+              "rely on it\n", APP_NAME, threads[i].core_i,
+              threads[i].frc_offset, threads[i].frc_offset_err,
+              g.housekeeping_core);
+  /* Streaming leaves the collector working after the threads are done, so
+   * only without it can the threads go on to post-process.
    */
+  g.post_in_threads = ! g.stream;
+  TEST(g.trial_results = malloc(g.n_trials * g.n_threads *
+                                sizeof(g.trial_results[0])));
+  g.raw_core_digits = raw_core_digits(threads);
+  if( g.daemon )
+    shm_create(threads);
+  g.trace_marker_fd = g.tracing_on_fd = -1;
+  if( g.trigger_nsec ) {
+    g.trace_marker_fd = tracefs_open("trace_marker");
+    if( g.trigger_stop )
+      g.tracing_on_fd = tracefs_open("tracing_on");
+    if( g.trace_marker_fd < 0 || (g.trigger_stop && g.tracing_on_fd < 0) )
+      fprintf(stderr, "%s: WARNING: Could not open tracefs (%s); trigger "
+              "events will only be reported\n", APP_NAME, strerror(errno));
+  }
+
   int err = 0;
-  if( raw_prefix )
-    err = write_raw(threads, raw_prefix);
-  write_summary(threads, stdout);
+  if( g.store_raw ) {
+    /* The raw buffers are sized with a short calibration run.  Otherwise
+     * memory use does not depend on the runtime, so no need.  Any load is
+     * on, as it will only add interruptions.
+     */
+    g.loading = g.n_loads > 0;
+    run_expt(threads, 1, 1);
+    calc_max_interruptions(threads, runtime);
+    cleanup_expt(threads);
+  }
+  if( g.n_loads ) {
+    /* First without the load, to compare with. */
+    const char* raw_prefix = g.raw_prefix;
+    char noload_prefix[raw_prefix ? strlen(raw_prefix) + 8 : 1];
+    if( raw_prefix != NULL ) {
+      sprintf(noload_prefix, "%s-noload", raw_prefix);
+      g.raw_prefix = noload_prefix;
+    }
+    g.loading = 0;
+    err = measure(threads, runtime);
+    cleanup_expt(threads);
+    g.raw_prefix = raw_prefix;
+    g.loading = 1;
+  }
+  rc = measure(threads, runtime);
+  if( ! err )
+    err = rc;
+  if( g.baseline_save != NULL && (rc = save_baseline(threads, g.baseline_save)) )
+    err = rc;
+  if( g.baseline_compare != NULL &&
+      (rc = compare_baseline(threads, g.baseline_compare)) )
+    err = err ? err : rc;
+#ifdef SYSJITTER_MPI
+  write_job_report(threads);
+  MPI_Finalize();
+#endif
+  if( g.shm != NULL )
+    shm_unlink(SJ_SHM_NAME);
   return err;
 }
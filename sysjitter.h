@@ -0,0 +1,265 @@
+/*
+ * sysjitter
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libsysjitter: the timestamp counter, histogram and stats used by
+ * sysjitter, for measuring the jitter seen inside an application's own
+ * polling loop.
+ *
+ * Each polling thread has a [struct sj_probe]:
+ *
+ *   struct sj_probe p;
+ *   sj_probe_init(&p, 1000, 0);
+ *   sj_probe_start(&p);
+ *   while( ! done ) {
+ *     sj_probe(&p);
+ *     poll_something();
+ *   }
+ *   sj_probe_snapshot(&p, &stats);
+ *   sj_stats_write(&stats, stdout);
+ *   sj_probe_free(&p);
+ *
+ * sj_probe() costs a read of the timestamp counter and a compare, except
+ * when the gap since the last call is at least the threshold.  A probe
+ * belongs to one thread, but another thread may take snapshots of it.
+ */
+
+#ifndef SYSJITTER_H
+#define SYSJITTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/* Reads the timestamp counter. */
+#ifdef __GNUC__
+# if defined(__x86_64__)
+static inline void sj_frc(uint64_t* pval)
+{
+  uint32_t low, high;
+  __asm__ __volatile__("rdtsc" : "=a" (low) , "=d" (high));
+  *pval = ((uint64_t) high << 32) | low;
+}
+# elif defined(__i386__)
+static inline void sj_frc(uint64_t* pval)
+{
+  __asm__ __volatile__("rdtsc" : "=A" (*pval));
+}
+# elif defined(__PPC64__)
+static inline void sj_frc(uint64_t* pval)
+{
+  __asm__ __volatile__("mfspr %0, 268\n" : "=r" (*pval));
+}
+# elif defined(__aarch64__)
+static inline void sj_frc(uint64_t* pval)
+{
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(*pval));
+}
+# else
+#  error Need sj_frc() for this platform.
+# endif
+#else
+# error Need to add support for this compiler.
+#endif
+
+
+/* Serialised reads of the counter: these wait for earlier instructions
+ * to finish first.  sj_frc_rdtscp() also gives the TSC_AUX of the core it
+ * ran on.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static inline void sj_frc_rdtscp(uint64_t* pval, unsigned* aux)
+{
+  uint32_t low, high;
+  __asm__ __volatile__("rdtscp" : "=a" (low), "=d" (high), "=c" (*aux));
+  *pval = ((uint64_t) high << 32) | low;
+}
+
+static inline void sj_frc_lfence(uint64_t* pval)
+{
+  uint32_t low, high;
+  __asm__ __volatile__("lfence; rdtsc" : "=a" (low), "=d" (high));
+  *pval = ((uint64_t) high << 32) | low;
+}
+#elif defined(__aarch64__)
+static inline void sj_frc_isb(uint64_t* pval)
+{
+  __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (*pval));
+}
+#endif
+
+
+/* Log-linear histogram of lengths in ticks: values below 2*SJ_HIST_SUB_N
+ * get a bucket each, and each power of 2 above that is split into
+ * SJ_HIST_SUB_N buckets, so the error is under 1%.
+ */
+#define SJ_HIST_SUB_BITS   7
+#define SJ_HIST_SUB_N      (1u << SJ_HIST_SUB_BITS)
+#define SJ_HIST_N_BUCKETS  ((65 - SJ_HIST_SUB_BITS) * SJ_HIST_SUB_N)
+
+struct sj_histogram {
+  uint64_t             counts[SJ_HIST_N_BUCKETS];
+};
+
+
+static inline unsigned sj_hist_bucket(uint64_t v)
+{
+  /* OR-ing in SJ_HIST_SUB_N makes small values land in the linear range
+   * (shift == 0) without a branch.
+   */
+  unsigned shift = 63 - __builtin_clzll(v | SJ_HIST_SUB_N) - SJ_HIST_SUB_BITS;
+  return (shift << SJ_HIST_SUB_BITS) + (unsigned) (v >> shift);
+}
+
+
+/* Other threads may read the counts while we're measuring, so make sure
+ * they are updated with a single store.
+ */
+static inline void sj_hist_inc(uint64_t* counts, uint64_t v)
+{
+  uint64_t* c = &(counts[sj_hist_bucket(v)]);
+  __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Highest value that lands in the given bucket. */
+extern uint64_t sj_hist_bucket_max(unsigned b);
+
+/* Returns the value with [rank] values below it (counting from zero), to
+ * the precision of the histogram, clamped to [min] and [max].
+ */
+extern uint64_t sj_hist_value_at_rank(const struct sj_histogram* h,
+                                      uint64_t rank, uint64_t min,
+                                      uint64_t max);
+
+/* Rate of the timestamp counter according to the platform, or 0 if the
+ * platform doesn't say.
+ */
+extern unsigned sj_platform_cpu_mhz(void);
+
+/* Measures the rate of the timestamp counter against gettimeofday(). */
+extern unsigned sj_measure_cpu_mhz(void);
+
+/* Whether the TSC ticks at a constant rate in all C-states and P-states,
+ * by CPUID or else the kernel's constant_tsc and nonstop_tsc flags: 1 or
+ * 0, or -1 if there is no TSC.
+ */
+extern int sj_tsc_invariant(void);
+
+/* Whether the CPU has the rdtscp instruction. */
+extern int sj_has_rdtscp(void);
+
+/* The hypervisor we're running under ("kvm", "xen" and so on), or NULL
+ * if none is apparent.
+ */
+extern const char* sj_hypervisor(void);
+
+
+struct sj_probe {
+  uint64_t             prev;
+  uint64_t             threshold;     /* ticks */
+  uint64_t             start;
+  uint64_t             int_n;
+  uint64_t             int_total;
+  uint64_t             int_min;
+  uint64_t             int_max;
+  unsigned             cpu_mhz;
+  struct sj_histogram* hist;
+};
+
+
+/* Summary of a probe, as in the sysjitter summary.  Lengths are in ns. */
+struct sj_stats {
+  unsigned             cpu_mhz;
+  uint64_t             runtime;
+  uint64_t             int_n;
+  uint64_t             int_min;
+  uint64_t             int_median;
+  uint64_t             int_mean;
+  uint64_t             int_90;
+  uint64_t             int_99;
+  uint64_t             int_999;
+  uint64_t             int_9999;
+  uint64_t             int_99999;
+  uint64_t             int_max;
+  uint64_t             int_total;
+  double               int_total_pc;
+};
+
+
+/* Sets up a probe that records gaps of at least [threshold_nsec].  If
+ * [cpu_mhz] is 0 the counter rate is found from the platform, or else
+ * measured (which takes a few milliseconds).  Returns 0, or -1 if out of
+ * memory.
+ */
+extern int sj_probe_init(struct sj_probe* p, unsigned threshold_nsec,
+                         unsigned cpu_mhz);
+
+extern void sj_probe_free(struct sj_probe* p);
+
+/* Forgets what has been recorded and starts again from now. */
+extern void sj_probe_start(struct sj_probe* p);
+
+extern void sj_probe_record(struct sj_probe* p, uint64_t diff);
+
+/* Call each time round the polling loop. */
+static inline void sj_probe(struct sj_probe* p)
+{
+  uint64_t now;
+
+  sj_frc(&now);
+  if( __builtin_expect(now - p->prev >= p->threshold, 0) )
+    sj_probe_record(p, now - p->prev);
+  p->prev = now;
+}
+
+
+/* The lengths in struct sj_stats in summary order, with their labels, so
+ * that everything writing stats labels them the same way.
+ */
+#define SJ_STATS_N_FIELDS  10
+
+struct sj_stats_field {
+  const char*          label;
+  size_t               offset;
+};
+
+extern const struct sj_stats_field sj_stats_fields[SJ_STATS_N_FIELDS];
+
+static inline uint64_t sj_stats_get(const struct sj_stats* s, unsigned k)
+{
+  return *(const uint64_t*) ((const char*) s + sj_stats_fields[k].offset);
+}
+
+
+/* Stats from [n] values in [h], the least being [min] and the greatest
+ * [max], over [runtime] ticks.  [total] is the sum of the values.
+ */
+extern void sj_stats_from_hist(struct sj_stats* s, unsigned cpu_mhz,
+                               const struct sj_histogram* h, uint64_t n,
+                               uint64_t min, uint64_t max, uint64_t total,
+                               uint64_t runtime);
+
+/* Stats for everything recorded since sj_probe_start(). */
+extern void sj_probe_snapshot(const struct sj_probe* p, struct sj_stats* s);
+
+/* Writes the stats as "label: value" lines, as in the sysjitter summary. */
+extern void sj_stats_write(const struct sj_stats* s, FILE* f);
+
+#endif  /* SYSJITTER_H */
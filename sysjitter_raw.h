@@ -0,0 +1,117 @@
+/*
+ * sysjitter
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Layout of the binary raw files written with --raw-format=bin.
+ *
+ * A file is a [struct sj_raw_header] followed by [n_records] packed
+ * [struct sj_raw_record]s starting at offset [header_size], so it can be
+ * mmapped and indexed directly.  All fields are in the byte order of the
+ * host that wrote the file.  Timestamps and lengths are in ticks of the
+ * timestamp counter (see cpu_mhz).
+ */
+
+#ifndef SYSJITTER_RAW_H
+#define SYSJITTER_RAW_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+#define SJ_RAW_MAGIC      "SJITRAW"
+#define SJ_RAW_VERSION    2
+
+/* Records are sorted by length rather than by timestamp (--sort). */
+#define SJ_RAW_F_SORTED   0x1
+/* Written in streaming mode, so n_dropped is meaningful. */
+#define SJ_RAW_F_STREAM   0x2
+/* The records are followed by [n_records] uint32_t cause masks, one per
+ * record and in the same order (--perf-causes).
+ */
+#define SJ_RAW_F_CAUSES   0x4
+
+
+/* What the timestamps were read with (version 2 on). */
+#define SJ_CLOCK_UNKNOWN        0
+#define SJ_CLOCK_RDTSC          1
+#define SJ_CLOCK_RDTSCP         2
+#define SJ_CLOCK_LFENCE_RDTSC   3
+#define SJ_CLOCK_CNTVCT         4
+#define SJ_CLOCK_ISB_CNTVCT     5
+#define SJ_CLOCK_CLOCK_GETTIME  6  /* CLOCK_MONOTONIC, in ns */
+#define SJ_CLOCK_MFTB           7
+#define SJ_N_CLOCKS             8
+#define SJ_CLOCK_NAMES  { "unknown", "rdtsc", "rdtscp", "lfence-rdtsc",     \
+                          "cntvct", "isb-cntvct", "clock_gettime", "mftb" }
+
+
+/* Bits in a cause mask: the kernel events seen during an interruption. */
+#define SJ_CAUSE_SCHED    0x01  /* context switch */
+#define SJ_CAUSE_IRQ      0x02  /* device interrupt handler */
+#define SJ_CAUSE_SOFTIRQ  0x04
+#define SJ_CAUSE_FAULT    0x08  /* page fault */
+#define SJ_CAUSE_TIMER    0x10  /* timer or hrtimer expiry */
+#define SJ_CAUSE_TICK     0x20  /* local timer interrupt (x86 only) */
+#define SJ_N_CAUSES       6
+#define SJ_CAUSE_NAMES    { "sched", "irq", "softirq", "fault", "timer", \
+                            "tick" }
+
+
+struct sj_raw_header {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  header_size;
+  uint32_t  cpu_mhz;
+  uint32_t  threshold_nsec;
+  int32_t   core_i;
+  uint32_t  flags;
+  uint64_t  frc_start;
+  uint64_t  frc_stop;
+  uint64_t  int_total;
+  uint64_t  n_records;
+  uint64_t  n_dropped;
+  uint32_t  clock;
+  uint32_t  reserved0;
+  uint64_t  reserved[2];
+};
+
+
+struct sj_raw_record {
+  uint64_t  ts;
+  uint64_t  diff;
+};
+
+
+/* Formats a cause mask as a comma separated list of names, or "-". */
+static inline const char* sj_format_causes(char* buf, size_t len,
+                                           uint32_t mask)
+{
+  static const char* const names[] = SJ_CAUSE_NAMES;
+  size_t off = 0;
+  int i;
+
+  buf[0] = '\0';
+  for( i = 0; i < SJ_N_CAUSES; ++i )
+    if( (mask & (1u << i)) && off < len )
+      off += snprintf(buf + off, len - off, "%s%s", off ? "," : "", names[i]);
+  if( off == 0 )
+    snprintf(buf, len, "-");
+  return buf;
+}
+
+#endif  /* SYSJITTER_RAW_H */
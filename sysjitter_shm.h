@@ -0,0 +1,109 @@
+/*
+ * sysjitter
+ *
+ * Copyright 2010-2017 David Riddoch <david@riddoch.org.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Layout of the shared memory segment published with --daemon.
+ *
+ * The segment (shm_open(SJ_SHM_NAME), i.e. /dev/shm/sysjitter) is a
+ * [struct sj_shm_header], then [n_buckets] uint64_t bucket upper bounds
+ * at [buckets_off], then [n_cores] [struct sj_shm_core]s every [core_size]
+ * bytes from [cores_off].  Each core block ends with [n_buckets] counts
+ * since the start of the run followed by [n_buckets] counts for the last
+ * interval.  Interruption lengths and bucket bounds are in ticks of the
+ * timestamp counter (see cpu_mhz).
+ *
+ * [magic] is set when the run starts, and the header does not change
+ * after that, so wait for it before reading the rest.  Each core block is
+ * rewritten once an interval under a seqlock: use sj_shm_read_core() to
+ * take a consistent copy.  Readers never hold up the writer.
+ */
+
+#ifndef SYSJITTER_SHM_H
+#define SYSJITTER_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define SJ_SHM_NAME       "/sysjitter"
+#define SJ_SHM_MAGIC      "SJITSHM"
+#define SJ_SHM_VERSION    1
+
+
+struct sj_shm_header {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  n_cores;
+  uint32_t  n_buckets;
+  uint32_t  threshold_nsec;
+  uint32_t  buckets_off;
+  uint32_t  cores_off;
+  uint32_t  core_size;
+  uint32_t  reserved0;
+  uint64_t  interval_nsec;
+  uint64_t  start_ns;               /* CLOCK_REALTIME */
+  uint64_t  reserved[4];
+};
+
+
+struct sj_shm_core {
+  uint32_t  seq;                    /* odd while being updated */
+  int32_t   core_i;
+  uint32_t  cpu_mhz;
+  uint32_t  reserved0;
+  uint64_t  update_ns;              /* CLOCK_REALTIME of the update */
+  uint64_t  n_intervals;
+  uint64_t  int_n;
+  uint64_t  int_max;
+  uint64_t  interval_int_n;
+  uint64_t  interval_int_max;
+  uint64_t  counts[];
+};
+
+
+static inline const uint64_t* sj_shm_buckets(const struct sj_shm_header* h)
+{
+  return (const void*) ((const char*) h + h->buckets_off);
+}
+
+
+static inline struct sj_shm_core* sj_shm_core(const struct sj_shm_header* h,
+                                              unsigned i)
+{
+  return (void*) ((char*) h + h->cores_off + (size_t) i * h->core_size);
+}
+
+
+/* Copies [h->core_size] bytes of core block [i] to [out], retrying until
+ * the copy was not torn by an update.
+ */
+static inline void sj_shm_read_core(const struct sj_shm_header* h,
+                                    unsigned i, struct sj_shm_core* out)
+{
+  const struct sj_shm_core* c = sj_shm_core(h, i);
+  uint32_t seq;
+
+  do {
+    while( (seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)) & 1 )
+      ;
+    memcpy(out, c, h->core_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while( __atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq );
+}
+
+#endif  /* SYSJITTER_SHM_H */